@@ -0,0 +1,108 @@
+/* Allocation hooks for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include "config.h"
+
+#include "alloc.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libcexcept-private.h"
+
+/* The default hooks, which just forward to the C library.  */
+
+static void *
+default_alloc (size_t size, void *ctx)
+{
+  return malloc (size);
+}
+
+static void *
+default_realloc (void *ptr, size_t size, void *ctx)
+{
+  return realloc (ptr, size);
+}
+
+static void
+default_free (void *ptr, void *ctx)
+{
+  free (ptr);
+}
+
+/* The currently installed hooks.  */
+static cexcept_alloc_ftype *alloc_hook = default_alloc;
+static cexcept_realloc_ftype *realloc_hook = default_realloc;
+static cexcept_free_ftype *free_hook = default_free;
+static void *alloc_hook_ctx;
+
+CEXCEPT_EXPORT void
+cexcept_set_allocator (cexcept_alloc_ftype *alloc_fn,
+		       cexcept_realloc_ftype *realloc_fn,
+		       cexcept_free_ftype *free_fn,
+		       void *ctx)
+{
+  alloc_hook = alloc_fn != NULL ? alloc_fn : default_alloc;
+  realloc_hook = realloc_fn != NULL ? realloc_fn : default_realloc;
+  free_hook = free_fn != NULL ? free_fn : default_free;
+  alloc_hook_ctx = ctx;
+}
+
+/* Called when an allocation hook fails.  There is no way to report
+   this through an exception, as throwing needs memory itself.  */
+
+static void ATTRIBUTE_NORETURN
+malloc_failure (size_t size)
+{
+  fprintf (stderr, "libcexcept: out of memory allocating %lu bytes\n",
+	   (unsigned long) size);
+  abort ();
+}
+
+void *
+cexcept_xmalloc (size_t size)
+{
+  void *p = alloc_hook (size, alloc_hook_ctx);
+
+  if (p == NULL)
+    malloc_failure (size);
+  return p;
+}
+
+void *
+cexcept_xzalloc (size_t size)
+{
+  return memset (cexcept_xmalloc (size), 0, size);
+}
+
+void *
+cexcept_xrealloc (void *ptr, size_t size)
+{
+  void *p = realloc_hook (ptr, size, alloc_hook_ctx);
+
+  if (p == NULL)
+    malloc_failure (size);
+  return p;
+}
+
+void
+cexcept_xfree (void *ptr)
+{
+  if (ptr != NULL)
+    free_hook (ptr, alloc_hook_ctx);
+}
@@ -0,0 +1,137 @@
+/* Growable buffers for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include "config.h"
+
+#include "buf.h"
+#include "cleanups.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libcexcept-private.h"
+
+/* The smallest storage allocated for a buffer.  */
+#define BUF_MIN_ALLOC 64
+
+/* Free the memory of BUF, unless it is the inline storage.  */
+
+static void
+free_buf_data (struct cexcept_buf *buf)
+{
+  if (buf->data != buf->inline_data)
+    cexcept_xfree (buf->data);
+}
+
+static void
+buf_cleanup (void *arg)
+{
+  free_buf_data (arg);
+}
+
+CEXCEPT_EXPORT void
+cexcept_buf_init (struct cexcept_buf *buf, void *inline_data,
+		  size_t inline_size)
+{
+  buf->data = inline_data;
+  buf->len = 0;
+  buf->alloc = inline_data != NULL ? inline_size : 0;
+  buf->inline_data = inline_data;
+  cexcept_make_cancelable_cleanup (buf_cleanup, buf, NULL, &buf->cleanup);
+}
+
+CEXCEPT_EXPORT void *
+cexcept_buf_reserve (struct cexcept_buf *buf, size_t size)
+{
+  size_t alloc;
+
+  if (buf->alloc - buf->len >= size)
+    return buf->data + buf->len;
+
+  if (size > SIZE_MAX - buf->len)
+    cexcept_throw_error (-EOVERFLOW, "buffer of %zu bytes cannot grow by %zu",
+			 buf->len, size);
+
+  /* Past half the address space, stop doubling.  */
+  if (buf->alloc > SIZE_MAX / 2)
+    alloc = buf->len + size;
+  else
+    alloc = (buf->alloc > BUF_MIN_ALLOC / 2
+	     ? buf->alloc * 2 : BUF_MIN_ALLOC);
+  if (alloc < buf->len + size)
+    alloc = buf->len + size;
+
+  if (buf->data == buf->inline_data)
+    {
+      char *data = cexcept_xmalloc (alloc);
+
+      if (buf->len != 0)
+	memcpy (data, buf->data, buf->len);
+      buf->data = data;
+    }
+  else
+    buf->data = cexcept_xrealloc (buf->data, alloc);
+  buf->alloc = alloc;
+
+  return buf->data + buf->len;
+}
+
+CEXCEPT_EXPORT void
+cexcept_buf_commit (struct cexcept_buf *buf, size_t size)
+{
+  buf->len += size;
+}
+
+CEXCEPT_EXPORT void
+cexcept_buf_append (struct cexcept_buf *buf, const void *data, size_t size)
+{
+  memcpy (cexcept_buf_reserve (buf, size), data, size);
+  buf->len += size;
+}
+
+CEXCEPT_EXPORT void *
+cexcept_buf_release (struct cexcept_buf *buf, size_t *len)
+{
+  char *data = buf->data;
+
+  if (data == buf->inline_data)
+    {
+      data = cexcept_xmalloc (buf->len != 0 ? buf->len : 1);
+      if (buf->len != 0)
+	memcpy (data, buf->data, buf->len);
+    }
+
+  if (len != NULL)
+    *len = buf->len;
+
+  cexcept_cancel_cleanup (buf->cleanup);
+  buf->data = buf->inline_data;
+  buf->len = 0;
+  buf->alloc = 0;
+  return data;
+}
+
+CEXCEPT_EXPORT void
+cexcept_buf_done (struct cexcept_buf *buf)
+{
+  free_buf_data (buf);
+  cexcept_cancel_cleanup (buf->cleanup);
+  buf->data = buf->inline_data;
+  buf->len = 0;
+  buf->alloc = 0;
+}
@@ -0,0 +1,464 @@
+/* Message catalog for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* A message thrown by id has its arguments captured when thrown, by
+   walking its format to find their types, and is rendered later by
+   walking the format again, formatting one conversion at a time with
+   the argument captured for it.  */
+
+#include "config.h"
+
+#include "catalog.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcexcept-private.h"
+
+/* The catalog messages are thrown from.  */
+static const struct cexcept_catalog *message_catalog;
+
+CEXCEPT_EXPORT const struct cexcept_catalog *
+cexcept_set_message_catalog (const struct cexcept_catalog *catalog)
+{
+  return __atomic_exchange_n (&message_catalog, catalog, __ATOMIC_ACQ_REL);
+}
+
+/* Return the format of message ID, or NULL if it is not in the
+   catalog.  */
+
+const char *
+cexcept_catalog_format (unsigned int id)
+{
+  const struct cexcept_catalog *catalog
+    = __atomic_load_n (&message_catalog, __ATOMIC_ACQUIRE);
+
+  if (catalog == NULL || id >= catalog->count)
+    return NULL;
+  return catalog->formats[id];
+}
+
+/* The type of argument a conversion takes.  */
+enum conversion_type
+{
+  CONVERSION_INT,
+  CONVERSION_LONG,
+  CONVERSION_LONG_LONG,
+  CONVERSION_INTMAX,
+  CONVERSION_SIZE,
+  CONVERSION_PTRDIFF,
+  CONVERSION_DOUBLE,
+  CONVERSION_LONG_DOUBLE,
+  CONVERSION_STRING,
+  CONVERSION_POINTER
+};
+
+/* The longest conversion specification handled.  */
+#define CONVERSION_MAX 31
+
+struct conversion
+{
+  /* The specification, from the '%' to the conversion character.  */
+  const char *start;
+  size_t len;
+  /* The number of '*'s, and whether the last one is the
+     precision.  */
+  int nstars;
+  int star_precision;
+  /* The precision, if given as digits, or -1.  */
+  int precision;
+  enum conversion_type type;
+};
+
+/* Parse the conversion specification at P, which starts with a '%'
+   that is not part of "%%", into *CONV.  Return the end of it, or
+   NULL if it is not supported.  */
+
+static const char *
+parse_conversion (const char *p, struct conversion *conv)
+{
+  char length = 0;
+
+  conv->start = p++;
+  conv->nstars = 0;
+  conv->star_precision = 0;
+  conv->precision = -1;
+
+  while (*p != '\0' && strchr ("-+ #0'", *p) != NULL)
+    p++;
+
+  if (*p == '*')
+    {
+      conv->nstars++;
+      p++;
+    }
+  else
+    while (*p >= '0' && *p <= '9')
+      p++;
+
+  if (*p == '.')
+    {
+      p++;
+      if (*p == '*')
+	{
+	  conv->nstars++;
+	  conv->star_precision = 1;
+	  p++;
+	}
+      else
+	{
+	  conv->precision = 0;
+	  while (*p >= '0' && *p <= '9')
+	    {
+	      if (conv->precision < 100000)
+		conv->precision = conv->precision * 10 + (*p - '0');
+	      p++;
+	    }
+	}
+    }
+
+  switch (*p)
+    {
+    case 'h':
+      p++;
+      if (*p == 'h')
+	p++;
+      length = 'h';
+      break;
+    case 'l':
+      p++;
+      if (*p == 'l')
+	{
+	  p++;
+	  length = 'q';
+	}
+      else
+	length = 'l';
+      break;
+    case 'q':
+    case 'L':
+    case 'j':
+    case 'z':
+    case 't':
+      length = *p++;
+      break;
+    }
+
+  switch (*p)
+    {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+      switch (length)
+	{
+	case 'l':
+	  conv->type = CONVERSION_LONG;
+	  break;
+	case 'q':
+	case 'L':
+	  conv->type = CONVERSION_LONG_LONG;
+	  break;
+	case 'j':
+	  conv->type = CONVERSION_INTMAX;
+	  break;
+	case 'z':
+	  conv->type = CONVERSION_SIZE;
+	  break;
+	case 't':
+	  conv->type = CONVERSION_PTRDIFF;
+	  break;
+	default:
+	  conv->type = CONVERSION_INT;
+	  break;
+	}
+      break;
+    case 'c':
+      if (length != 0)
+	return NULL;
+      conv->type = CONVERSION_INT;
+      break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      if (length == 'L')
+	conv->type = CONVERSION_LONG_DOUBLE;
+      else if (length == 0 || length == 'l')
+	conv->type = CONVERSION_DOUBLE;
+      else
+	return NULL;
+      break;
+    case 's':
+      if (length != 0)
+	return NULL;
+      conv->type = CONVERSION_STRING;
+      break;
+    case 'p':
+      if (length != 0)
+	return NULL;
+      conv->type = CONVERSION_POINTER;
+      break;
+    default:
+      /* Including %n, positional arguments and the end of the
+	 format.  */
+      return NULL;
+    }
+
+  p++;
+  conv->len = p - conv->start;
+  if (conv->len > CONVERSION_MAX)
+    return NULL;
+  return p;
+}
+
+/* Copy the first LEN characters of STRING into MESSAGE's strings, and
+   return their offset.  */
+
+static size_t
+capture_string (struct cexcept_message *message, const char *string,
+		size_t len)
+{
+  size_t offset = message->strings_used;
+
+  if (message->strings_size - offset < len + 1)
+    {
+      size_t size = message->strings_size ? message->strings_size : 64;
+
+      while (size - offset < len + 1)
+	size *= 2;
+      message->strings = cexcept_xrealloc (message->strings, size);
+      message->strings_size = size;
+    }
+
+  memcpy (message->strings + offset, string, len);
+  message->strings[offset + len] = '\0';
+  message->strings_used = offset + len + 1;
+  return offset;
+}
+
+/* The offset of a NULL string argument.  */
+#define NULL_STRING ((size_t) -1)
+
+/* Capture into MESSAGE the arguments in AP for its format.  */
+
+void
+cexcept_message_capture (struct cexcept_message *message, va_list ap)
+{
+  union cexcept_message_arg *arg = message->args;
+  union cexcept_message_arg *end = arg + CEXCEPT_MESSAGE_MAX_ARGS;
+  const char *p = message->format;
+  struct conversion conv;
+
+  message->nconversions = 0;
+  message->strings_used = 0;
+
+  while ((p = strchr (p, '%')) != NULL)
+    {
+      int precision, i;
+
+      if (p[1] == '%')
+	{
+	  p += 2;
+	  continue;
+	}
+
+      p = parse_conversion (p, &conv);
+      if (p == NULL || end - arg < conv.nstars + 1)
+	break;
+
+      for (i = 0; i < conv.nstars; i++)
+	(arg++)->i = va_arg (ap, int);
+      precision = conv.star_precision ? arg[-1].i : conv.precision;
+
+      switch (conv.type)
+	{
+	case CONVERSION_INT:
+	  arg->i = va_arg (ap, int);
+	  break;
+	case CONVERSION_LONG:
+	  arg->l = va_arg (ap, long);
+	  break;
+	case CONVERSION_LONG_LONG:
+	  arg->ll = va_arg (ap, long long);
+	  break;
+	case CONVERSION_INTMAX:
+	  arg->j = va_arg (ap, intmax_t);
+	  break;
+	case CONVERSION_SIZE:
+	  arg->z = va_arg (ap, size_t);
+	  break;
+	case CONVERSION_PTRDIFF:
+	  arg->t = va_arg (ap, ptrdiff_t);
+	  break;
+	case CONVERSION_DOUBLE:
+	  arg->d = va_arg (ap, double);
+	  break;
+	case CONVERSION_LONG_DOUBLE:
+	  arg->ld = va_arg (ap, long double);
+	  break;
+	case CONVERSION_STRING:
+	  {
+	    const char *string = va_arg (ap, const char *);
+
+	    if (string == NULL)
+	      arg->offset = NULL_STRING;
+	    else
+	      arg->offset
+		= capture_string (message, string,
+				  precision >= 0
+				  ? strnlen (string, precision)
+				  : strlen (string));
+	  }
+	  break;
+	case CONVERSION_POINTER:
+	  arg->p = va_arg (ap, const void *);
+	  break;
+	}
+
+      arg++;
+      message->nconversions++;
+    }
+}
+
+/* Append the LEN characters at S to the text being rendered into OUT,
+   of SIZE bytes, of which *USED are used so far.  */
+
+static void
+render_literal (char *out, size_t size, size_t *used, const char *s,
+		size_t len)
+{
+  if (*used < size)
+    memcpy (out + *used, s, *used + len <= size ? len : size - *used);
+  *used += len;
+}
+
+/* Render MESSAGE into OUT, of SIZE bytes, and return the length of
+   the whole text, as snprintf does.  */
+
+static size_t
+render_message (const struct cexcept_message *message, char *out,
+		size_t size)
+{
+  const union cexcept_message_arg *arg = message->args;
+  const char *p = message->format;
+  struct conversion conv;
+  size_t used = 0;
+  int i = 0;
+
+  if (p == NULL)
+    return snprintf (out, size, "unknown message %u", message->id);
+
+  while (*p != '\0')
+    {
+      char spec[CONVERSION_MAX + 1];
+      char *dst;
+      size_t room;
+      const char *string;
+      int len = 0;
+
+      if (p[0] == '%' && p[1] == '%')
+	{
+	  render_literal (out, size, &used, p, 1);
+	  p += 2;
+	  continue;
+	}
+      if (p[0] != '%' || i == message->nconversions)
+	{
+	  render_literal (out, size, &used, p, 1);
+	  p++;
+	  continue;
+	}
+
+      p = parse_conversion (p, &conv);
+      memcpy (spec, conv.start, conv.len);
+      spec[conv.len] = '\0';
+      dst = used < size ? out + used : NULL;
+      room = used < size ? size - used : 0;
+
+#define RENDER_ARG(VALUE)						\
+      (conv.nstars == 0 ? snprintf (dst, room, spec, (VALUE))		\
+       : conv.nstars == 1 ? snprintf (dst, room, spec, arg[0].i, (VALUE)) \
+       : snprintf (dst, room, spec, arg[0].i, arg[1].i, (VALUE)))
+
+      switch (conv.type)
+	{
+	case CONVERSION_INT:
+	  len = RENDER_ARG (arg[conv.nstars].i);
+	  break;
+	case CONVERSION_LONG:
+	  len = RENDER_ARG (arg[conv.nstars].l);
+	  break;
+	case CONVERSION_LONG_LONG:
+	  len = RENDER_ARG (arg[conv.nstars].ll);
+	  break;
+	case CONVERSION_INTMAX:
+	  len = RENDER_ARG (arg[conv.nstars].j);
+	  break;
+	case CONVERSION_SIZE:
+	  len = RENDER_ARG (arg[conv.nstars].z);
+	  break;
+	case CONVERSION_PTRDIFF:
+	  len = RENDER_ARG (arg[conv.nstars].t);
+	  break;
+	case CONVERSION_DOUBLE:
+	  len = RENDER_ARG (arg[conv.nstars].d);
+	  break;
+	case CONVERSION_LONG_DOUBLE:
+	  len = RENDER_ARG (arg[conv.nstars].ld);
+	  break;
+	case CONVERSION_STRING:
+	  string = (arg[conv.nstars].offset == NULL_STRING ? NULL
+		    : message->strings + arg[conv.nstars].offset);
+	  len = RENDER_ARG (string);
+	  break;
+	case CONVERSION_POINTER:
+	  len = RENDER_ARG (arg[conv.nstars].p);
+	  break;
+	}
+
+#undef RENDER_ARG
+
+      if (len > 0)
+	used += len;
+      arg += conv.nstars + 1;
+      i++;
+    }
+
+  if (size > 0)
+    out[used < size ? used : size - 1] = '\0';
+  return used;
+}
+
+/* Return the text of MESSAGE, a catalog message, in memory of its
+   own.  */
+
+char *
+cexcept_message_render (const struct cexcept_message *message)
+{
+  size_t len = render_message (message, NULL, 0);
+  char *text = cexcept_xmalloc (len + 1);
+
+  render_message (message, text, len + 1);
+  return text;
+}
@@ -0,0 +1,231 @@
+/* Decode an exception flight recorder file.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Usage: cexcept-dump FILE
+
+   Print the exceptions recorded in FILE by cexcept_recorder_open,
+   oldest first, merging the rings of all threads.  FILE may belong to
+   a running process, or be left over from one that has exited or
+   crashed.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder-format.h"
+
+/* A copy of a record, with the thread it came from.  */
+
+struct entry
+{
+  uint32_t tid;
+  struct recorder_record record;
+};
+
+static int
+compare_entries (const void *a, const void *b)
+{
+  const struct entry *ea = a;
+  const struct entry *eb = b;
+
+  if (ea->record.timestamp != eb->record.timestamp)
+    return ea->record.timestamp < eb->record.timestamp ? -1 : 1;
+  return (ea->record.seq > eb->record.seq)
+	  - (ea->record.seq < eb->record.seq);
+}
+
+/* Map PATH, storing its size in *SIZEP.  The file is mapped rather
+   than read so that records being written by a running process can be
+   told apart from complete ones; see copy_record.  */
+
+static const char *
+map_file (const char *path, size_t *sizep)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return NULL;
+    }
+  if (st.st_size == 0)
+    {
+      /* Too short for a header; let the caller say so.  */
+      close (fd);
+      *sizep = 0;
+      return "";
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return NULL;
+  *sizep = st.st_size;
+  return map;
+}
+
+/* Copy RECORD to COPY if it holds the record numbered SEQ + 1 from
+   start to end.  Return non-zero on success, zero if the slot has been
+   overwritten since, or is being written.  The writer zeroes SEQ before
+   rewriting a slot and stores the new SEQ last, so a copy framed by two
+   reads of the expected SEQ is not torn.  */
+
+static int
+copy_record (const struct recorder_record *record, uint64_t seq,
+	     struct recorder_record *copy)
+{
+  if (__atomic_load_n (&record->seq, __ATOMIC_ACQUIRE) != seq + 1)
+    return 0;
+  memcpy (copy, record, sizeof (*copy));
+  __atomic_thread_fence (__ATOMIC_ACQUIRE);
+  if (__atomic_load_n (&record->seq, __ATOMIC_RELAXED) != seq + 1)
+    return 0;
+  copy->seq = seq + 1;
+  copy->message[RECORDER_MESSAGE_SIZE - 1] = '\0';
+  return 1;
+}
+
+static const char *
+reason_name (int32_t reason)
+{
+  switch (reason)
+    {
+    case -1:
+      return "error";
+    case -2:
+      return "quit";
+    default:
+      return "?";
+    }
+}
+
+int
+main (int argc, char *argv[])
+{
+  const struct recorder_header *header;
+  const struct recorder_ring *rings;
+  const struct recorder_record *records;
+  struct entry *entries;
+  size_t size, n = 0;
+  uint32_t nrings, i;
+  const char *map;
+
+  if (argc != 2)
+    {
+      fprintf (stderr, "usage: %s FILE\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  map = map_file (argv[1], &size);
+  if (map == NULL)
+    {
+      fprintf (stderr, "%s: %s: %s\n", argv[0], argv[1], strerror (errno));
+      return EXIT_FAILURE;
+    }
+
+  header = (const struct recorder_header *) map;
+  if (size < sizeof (*header)
+      || memcmp (header->magic, RECORDER_MAGIC, sizeof (header->magic)) != 0
+      || header->version != RECORDER_VERSION
+      || header->record_size != sizeof (struct recorder_record)
+      || header->ring_records == 0
+      || (header->ring_records & (header->ring_records - 1)) != 0
+      || header->nrings == 0
+      || (size - sizeof (*header)) / header->nrings
+	  < (sizeof (struct recorder_ring)
+	     + (size_t) header->ring_records * sizeof (struct recorder_record)))
+    {
+      fprintf (stderr, "%s: %s: not a cexcept recorder file\n",
+	       argv[0], argv[1]);
+      return EXIT_FAILURE;
+    }
+
+  rings = (const struct recorder_ring *) (header + 1);
+  records = (const struct recorder_record *) (rings + header->nrings);
+  nrings = header->rings_used < header->nrings
+	   ? header->rings_used : header->nrings;
+
+  printf ("# pid %u, %u of %u threads recorded, %u records each\n",
+	  header->pid, nrings, header->nrings, header->ring_records);
+  if (header->rings_used > header->nrings)
+    printf ("# %u threads had no ring left\n",
+	    header->rings_used - header->nrings);
+
+  entries = malloc ((size_t) nrings * header->ring_records
+		    * sizeof (*entries) + 1);
+  if (entries == NULL)
+    {
+      fprintf (stderr, "%s: %s\n", argv[0], strerror (ENOMEM));
+      return EXIT_FAILURE;
+    }
+
+  for (i = 0; i < nrings; i++)
+    {
+      const struct recorder_record *ring
+	= records + (size_t) i * header->ring_records;
+      uint64_t head = __atomic_load_n (&rings[i].head, __ATOMIC_ACQUIRE);
+      uint64_t seq;
+
+      seq = head > header->ring_records ? head - header->ring_records : 0;
+      for (; seq < head; seq++)
+	{
+	  /* Skip records overwritten or torn since HEAD was read.  */
+	  if (!copy_record (&ring[seq & (header->ring_records - 1)], seq,
+			    &entries[n].record))
+	    continue;
+	  entries[n].tid = rings[i].tid;
+	  n++;
+	}
+    }
+
+  qsort (entries, n, sizeof (*entries), compare_entries);
+
+  for (i = 0; i < n; i++)
+    {
+      const struct recorder_record *record = &entries[i].record;
+      time_t secs = record->timestamp / 1000000000ULL;
+      struct tm tm;
+      char when[32];
+
+      gmtime_r (&secs, &tm);
+      strftime (when, sizeof (when), "%Y-%m-%dT%H:%M:%S", &tm);
+      printf ("%s.%09luZ tid %u depth %d %s %d pc 0x%llx: %.*s%s\n",
+	      when,
+	      (unsigned long) (record->timestamp % 1000000000ULL),
+	      entries[i].tid, record->depth,
+	      reason_name (record->reason), record->error,
+	      (unsigned long long) record->pc,
+	      RECORDER_MESSAGE_SIZE - 1, record->message,
+	      record->message_len >= RECORDER_MESSAGE_SIZE ? "..." : "");
+    }
+
+  free (entries);
+  if (size != 0)
+    munmap ((void *) map, size);
+  return EXIT_SUCCESS;
+}
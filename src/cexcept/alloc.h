@@ -0,0 +1,45 @@
+/* Allocation hooks for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_ALLOC_H
+#define CEXCEPT_ALLOC_H
+
+#include <stddef.h>
+
+/* Function types for the allocator hooks.  CTX is the opaque pointer
+   passed to cexcept_set_allocator.  The hooks follow the malloc,
+   realloc and free contracts; running out of memory is treated as
+   fatal.  */
+typedef void *(cexcept_alloc_ftype) (size_t size, void *ctx);
+typedef void *(cexcept_realloc_ftype) (void *ptr, size_t size, void *ctx);
+typedef void (cexcept_free_ftype) (void *ptr, void *ctx);
+
+/* Route every allocation the library makes internally (catchers,
+   cleanup records, exception messages) through ALLOC_FN, REALLOC_FN
+   and FREE_FN, passing CTX along.  Passing NULL for all three
+   restores the default malloc, realloc and free.
+
+   Memory is released with the allocator that is current at the time
+   of release, so this should be called before the library is first
+   used, and not while exceptions or cleanups are outstanding.  */
+
+extern void cexcept_set_allocator (cexcept_alloc_ftype *alloc_fn,
+				   cexcept_realloc_ftype *realloc_fn,
+				   cexcept_free_ftype *free_fn,
+				   void *ctx);
+
+#endif /* CEXCEPT_ALLOC_H */
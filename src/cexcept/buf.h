@@ -0,0 +1,92 @@
+/* Growable buffers for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_BUF_H
+#define CEXCEPT_BUF_H
+
+#include <stddef.h>
+
+struct cexcept_cleanup;
+
+/* A buffer that grows as data is added to it, and frees itself if an
+   exception is thrown before it is released.  It makes a single
+   cleanup when initialized, which always frees the buffer's current
+   memory, however many times it grew.  Small contents can live in
+   storage the caller provides, typically on the stack, so that they
+   need no allocation at all.
+
+   For instance:
+
+   char small[64];
+   struct cexcept_buf buf;
+
+   cexcept_buf_init (&buf, small, sizeof (small));
+   cexcept_buf_append (&buf, header, header_len);
+   ...  More appends; any of them, or anything else, may throw.
+   return cexcept_buf_release (&buf, &len);
+
+   The fields may be read, but not written.  */
+
+struct cexcept_buf
+{
+  /* The contents, LEN bytes of them, in ALLOC bytes of storage.  */
+  char *data;
+  size_t len;
+  size_t alloc;
+  /* The storage passed to cexcept_buf_init.  */
+  char *inline_data;
+  /* The buffer's cleanup, for cancelling it.  */
+  struct cexcept_cleanup *cleanup;
+};
+
+/* Start BUF empty, using the INLINE_SIZE bytes at INLINE_DATA (which
+   may be NULL) until it needs more, and make its cleanup.  BUF, and
+   INLINE_DATA, must stay in place until BUF is released or done, or
+   its cleanup is done.  */
+extern void cexcept_buf_init (struct cexcept_buf *buf, void *inline_data,
+			      size_t inline_size);
+
+/* Make room for SIZE more bytes in BUF, at least doubling its storage
+   if it has to grow, and return where they go.  The caller then adds
+   them with cexcept_buf_commit.  If the contents would then be larger
+   than SIZE_MAX bytes, an error with code -EOVERFLOW is thrown, and
+   BUF is left as it was.  */
+extern void *cexcept_buf_reserve (struct cexcept_buf *buf, size_t size);
+
+/* Add the SIZE bytes written at the address cexcept_buf_reserve
+   returned to the contents of BUF.  */
+extern void cexcept_buf_commit (struct cexcept_buf *buf, size_t size);
+
+/* Add the SIZE bytes at DATA to the contents of BUF.  */
+extern void cexcept_buf_append (struct cexcept_buf *buf, const void *data,
+				size_t size);
+
+/* Hand the contents of BUF over to the caller, and return them; store
+   their length in *LEN if LEN is non-NULL.  The result is always
+   allocated (contents still in the inline storage are copied), and
+   must be freed with free, or with the free hook of the allocator
+   installed with cexcept_set_allocator.  BUF's cleanup is cancelled,
+   in constant time; if no cleanup was made after it, as in the example
+   above, that leaves the cleanup chain as it was before
+   cexcept_buf_init.  */
+extern void *cexcept_buf_release (struct cexcept_buf *buf, size_t *len);
+
+/* Free the contents of BUF now, and cancel its cleanup, as
+   cexcept_buf_release does.  */
+extern void cexcept_buf_done (struct cexcept_buf *buf);
+
+#endif /* CEXCEPT_BUF_H */
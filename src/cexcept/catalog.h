@@ -0,0 +1,96 @@
+/* Message catalog for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_CATALOG_H
+#define CEXCEPT_CATALOG_H
+
+#include "cexcept/exceptions.h"
+
+#include <stdarg.h>
+
+/* Most exceptions are handled without their message ever being
+   looked at.  Throwing by message id, instead of with a format, only
+   captures the arguments; the text is rendered from the catalog's
+   format the first time cexcept_exception_message is called on the
+   exception.
+
+   A catalog maps message ids to printf formats.  It is usually
+   generated at compile time from a list macro, but may be built at
+   run time, for instance from a translation file, as long as each
+   format takes the same arguments as the one it replaces.
+
+   For instance:
+
+   *INDENT-OFF*
+
+   #define MY_MESSAGES(M)					\
+     M (MSG_NOT_FOUND, "%s: not found")			\
+     M (MSG_TOO_BIG, "size %zu is over the limit of %zu")
+
+   enum my_message { CEXCEPT_CATALOG_IDS (MY_MESSAGES) };
+   static CEXCEPT_CATALOG_DEFINE (my_catalog, MY_MESSAGES);
+
+   cexcept_set_message_catalog (&my_catalog);
+   ...
+   cexcept_throw_msg (NOT_FOUND_ERROR, MSG_NOT_FOUND, name);
+
+   *INDENT-ON*
+
+   Formats may use the flags, widths, precisions and length modifiers
+   of C99, including '*', with the conversions d, i, o, u, x, X, c, s,
+   p, f, F, e, E, g, G, a and A; %s arguments are copied when thrown.
+   Rendering stops at the first conversion that is not supported, or
+   past the first 8 arguments, and the rest of the format is copied as
+   is.  */
+
+struct cexcept_catalog
+{
+  /* The number of messages.  */
+  unsigned int count;
+  /* The format of each message, indexed by id.  */
+  const char *const *formats;
+};
+
+/* Expand LIST, a catalog list macro, to its ids, separated by
+   commas, and to the definition of a catalog NAME of its formats.  */
+#define CEXCEPT_CATALOG_ID(ID, FORMAT) ID,
+#define CEXCEPT_CATALOG_FORMAT(ID, FORMAT) FORMAT,
+#define CEXCEPT_CATALOG_IDS(LIST) LIST (CEXCEPT_CATALOG_ID)
+#define CEXCEPT_CATALOG_DEFINE(NAME, LIST)				\
+  const struct cexcept_catalog NAME =					\
+    {									\
+      sizeof ((const char *const []) { LIST (CEXCEPT_CATALOG_FORMAT) })	\
+	/ sizeof (const char *),					\
+      (const char *const []) { LIST (CEXCEPT_CATALOG_FORMAT) }		\
+    }
+
+/* Make CATALOG the catalog messages are thrown from, and return the
+   previous one.  A catalog must stay valid as long as exceptions
+   thrown from it may be rendered.  */
+extern const struct cexcept_catalog *cexcept_set_message_catalog
+  (const struct cexcept_catalog *catalog);
+
+/* Throw an error with message ID of the catalog, whose arguments
+   follow.  The exception's message is NULL; its text is got with
+   cexcept_exception_message.  An ID not in the catalog is rendered as
+   "unknown message ID".  */
+extern void cexcept_throw_msg (int error, unsigned int id, ...)
+     ATTRIBUTE_NORETURN;
+extern void cexcept_throw_vmsg (int error, unsigned int id, va_list ap)
+     ATTRIBUTE_NORETURN;
+
+#endif /* CEXCEPT_CATALOG_H */
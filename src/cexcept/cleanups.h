@@ -19,6 +19,9 @@
 #ifndef CLEANUPS_H
 #define CLEANUPS_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 /* Outside of cleanups.c, this is an opaque type.  */
 struct cexcept_cleanup;
 
@@ -46,9 +49,101 @@ extern struct cexcept_cleanup *
 			     void *,
 			     cexcept_make_cleanup_dtor_ftype *);
 
+/* The largest argument make_cleanup_inline copies.  */
+#define CEXCEPT_CLEANUP_INLINE_MAX 32
+
+/* Same as make_cleanup, except that the SIZE bytes at ARG, at most
+   CEXCEPT_CLEANUP_INLINE_MAX, are copied into the cleanup itself, and
+   the function is passed a pointer to the copy.  This saves allocating
+   a small argument, and a dtor to free it.  The copy is aligned for
+   pointers and long long, not for types needing more, such as long
+   double.  A larger SIZE throws an error with code -EINVAL, without
+   making the cleanup.  */
+
+extern struct cexcept_cleanup *
+  cexcept_make_cleanup_inline (cexcept_make_cleanup_ftype *,
+			       const void *arg, size_t size);
+
+/* Same as make_cleanup, except that when the cleanup is done, be it
+   by do_cleanups or while an exception is thrown, the function is not
+   called right away: it is queued, and called later by a background
+   thread.  This keeps slow cleanups (large unmappings, fsync, freeing
+   big caches) off the path of a throw.  The function must be safe to
+   call from another thread, and must not throw.
+   cexcept_drain_deferred waits until the functions of all the
+   deferred cleanups done so far, by any thread, have returned.  */
+
+extern struct cexcept_cleanup *
+  cexcept_make_cleanup_deferred (cexcept_make_cleanup_ftype *, void *);
+
+extern void cexcept_drain_deferred (void);
+
+/* Save a copy of the SIZE bytes at PTR in the calling thread's undo
+   journal, to be copied back if the cleanup is done, be it by
+   do_cleanups or while an exception is thrown.  This gives an update
+   of several structures all-or-nothing semantics without copying
+   them whole beforehand: save each range just before changing it, and
+   discard the cleanups once the update is complete.
+
+   The copies are taken from a per-thread arena, not allocated one by
+   one, and consecutive calls, with no other cleanup made in between,
+   share a single cleanup: the result of each is the chain before the
+   first of them, and doing or discarding it handles all their copies
+   at once, newest first.  Discarding them takes the same time however
+   many there are.  Undo cleanups must be done or discarded by the
+   thread that made them, and must not be moved with
+   transfer_cleanups.  */
+
+extern struct cexcept_cleanup *cexcept_make_undo (void *ptr, size_t size);
+
+/* Final cleanups are shared by all threads.  Making them, and doing
+   or discarding them, is safe from any thread and takes no lock.  */
+
 extern struct cexcept_cleanup *
   cexcept_make_final_cleanup (cexcept_make_cleanup_ftype *, void *);
 
+/* Same as make_final_cleanup, except that the cleanup is made on a
+   chain of the calling thread's, which is done when the thread exits
+   (through pthread_exit or by returning from its start function).  Use
+   it for per-thread caches and buffers.  The main thread's chain is
+   only done by an explicit do_thread_final_cleanups.  */
+
+extern struct cexcept_cleanup *
+  cexcept_make_thread_final_cleanup (cexcept_make_cleanup_ftype *, void *);
+
+/* Built-in cleanups that close the descriptor FD, close the stream
+   FILE, free PTR (allocated with malloc), or unmap the LEN bytes mapped
+   at ADDR.  Runs of consecutive built-in cleanups of the same kind are
+   performed together: descriptors in a contiguous range are closed
+   with one system call, and adjacent mappings are unmapped with one
+   system call.  Cleanups of other kinds keep their order relative to
+   these.  */
+
+extern struct cexcept_cleanup *cexcept_make_cleanup_close (int fd);
+extern struct cexcept_cleanup *cexcept_make_cleanup_fclose (FILE *file);
+extern struct cexcept_cleanup *cexcept_make_cleanup_free (void *ptr);
+extern struct cexcept_cleanup *cexcept_make_cleanup_munmap (void *addr,
+							    size_t len);
+
+/* Unlike the above, these deal in handles on individual cleanups.
+   make_cancelable_cleanup is make_cleanup_dtor (the dtor may be NULL)
+   that also stores in *HANDLE a handle on the cleanup just made.
+   cancel_cleanup disarms that one cleanup in constant time, wherever
+   it sits in the chain: its function will not be called, and its dtor
+   is called right away.  The newest cleanup is freed as well; one with
+   newer cleanups above it stays on the chain, doing nothing, until
+   they are done or discarded along with it.  The handle is valid until
+   the cleanup is cancelled, or done or discarded along with the rest
+   of the chain.  */
+
+extern struct cexcept_cleanup *
+  cexcept_make_cancelable_cleanup (cexcept_make_cleanup_ftype *,
+				   void *,
+				   cexcept_make_cleanup_dtor_ftype *,
+				   struct cexcept_cleanup **handle);
+
+extern void cexcept_cancel_cleanup (struct cexcept_cleanup *handle);
+
 /* A special value to pass to do_cleanups and do_final_cleanups
    to tell them to do all cleanups.  */
 extern struct cexcept_cleanup *cexcept_all_cleanups (void);
@@ -56,8 +151,32 @@ extern struct cexcept_cleanup *cexcept_all_cleanups (void);
 extern void cexcept_do_cleanups (struct cexcept_cleanup *);
 extern void cexcept_do_final_cleanups (struct cexcept_cleanup *);
 
+extern void cexcept_do_thread_final_cleanups (struct cexcept_cleanup *);
+
 extern void cexcept_discard_cleanups (struct cexcept_cleanup *);
 extern void cexcept_discard_final_cleanups (struct cexcept_cleanup *);
+extern void cexcept_discard_thread_final_cleanups (struct cexcept_cleanup *);
+
+/* Cleanups can also be kept on a chain of the caller's, declared as
+   "struct cexcept_cleanup *" and initialized with cexcept_all_cleanups.
+   These do and discard cleanups on such a chain.  */
+extern void cexcept_do_chain_cleanups (struct cexcept_cleanup **,
+				       struct cexcept_cleanup *);
+extern void cexcept_discard_chain_cleanups (struct cexcept_cleanup **,
+					    struct cexcept_cleanup *);
+
+/* Move the cleanups made since OLD_CHAIN off the cleanup chain, and
+   push them, in the same order, on the caller's chain *DEST or on the
+   final cleanup chain.  The cleanups are neither done nor discarded;
+   their destructors stay attached.  Moving them to a chain of the
+   caller's takes constant time; moving them to the final cleanup chain
+   takes them off the calling thread's counts (see below), which visits
+   each of them.  OLD_CHAIN must come from the cleanup chain, not from
+   *DEST.  */
+extern void cexcept_transfer_cleanups (struct cexcept_cleanup *old_chain,
+				       struct cexcept_cleanup **dest);
+extern void cexcept_transfer_cleanups_to_final
+  (struct cexcept_cleanup *old_chain);
 
 extern struct cexcept_cleanup *cexcept_save_cleanups (void);
 extern struct cexcept_cleanup *cexcept_save_final_cleanups (void);
@@ -65,6 +184,27 @@ extern struct cexcept_cleanup *cexcept_save_final_cleanups (void);
 extern void cexcept_restore_cleanups (struct cexcept_cleanup *);
 extern void cexcept_restore_final_cleanups (struct cexcept_cleanup *);
 
+/* Counts of the calling thread's cleanups, on any chain but the final
+   cleanup chain: how many there are and how much memory they take, now
+   and at most since the thread started or the peaks were last reset.
+   A cleanup is counted by the thread that makes it, and uncounted by
+   the thread that does or discards it, which should be the same.
+   Final cleanups, shared by all threads, are not counted, nor are
+   cleanups once transferred to the final cleanup chain.  A count that
+   keeps growing usually means a missing do_cleanups or
+   discard_cleanups.  */
+
+struct cexcept_cleanup_stats
+{
+  size_t count;
+  size_t bytes;
+  size_t peak_count;
+  size_t peak_bytes;
+};
+
+extern void cexcept_get_cleanup_stats (struct cexcept_cleanup_stats *stats);
+extern void cexcept_reset_cleanup_peaks (void);
+
 /* A no-op cleanup.
    This is useful when you want to establish a known reference point
    to pass to do_cleanups.  */
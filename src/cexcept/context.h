@@ -0,0 +1,44 @@
+/* Library context for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_CONTEXT_H
+#define CEXCEPT_CONTEXT_H
+
+#include <stdarg.h>
+
+/* The library context is reference counted.  References may be taken
+   and dropped from any thread, without locking; the memory is released
+   by whichever thread drops the last one.  See libcexcept.c for the
+   documentation of each function.  */
+
+struct cexcept_ctx;
+
+extern int cexcept_new (struct cexcept_ctx **ctx);
+extern struct cexcept_ctx *cexcept_ref (struct cexcept_ctx *ctx);
+extern struct cexcept_ctx *cexcept_unref (struct cexcept_ctx *ctx);
+extern void cexcept_set_log_fn
+  (struct cexcept_ctx *ctx,
+   void (*log_fn) (struct cexcept_ctx *, int priority, const char *file,
+		   int line, const char *fn, const char *format,
+		   va_list args));
+extern int cexcept_get_log_priority (struct cexcept_ctx *ctx);
+extern void cexcept_set_log_priority (struct cexcept_ctx *ctx,
+				      int priority);
+extern void *cexcept_get_userdata (struct cexcept_ctx *ctx);
+extern void cexcept_set_userdata (struct cexcept_ctx *ctx, void *userdata);
+
+#endif /* CEXCEPT_CONTEXT_H */
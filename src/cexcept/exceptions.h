@@ -21,6 +21,7 @@
 #define CEXCEPT_H
 
 #include "cexcept/priv/ansidecl.h"
+#include "cexcept/priv/backend.h"
 
 #include <setjmp.h>
 #include <stdarg.h>
@@ -47,17 +48,61 @@ typedef int return_mask;
 
 #define CEXCEPT_NO_ERROR 0
 
+/* Outside of exceptions.c, this is an opaque type.  */
+struct cexcept_message;
+
 struct cexception
 {
   enum cexcept_return_reason reason;
   int error;
   const char *message;
+  /* The reference counted storage MESSAGE lives in, for exceptions
+     thrown with a formatted message; NULL otherwise.  */
+  struct cexcept_message *message_ref;
+};
+
+/* A filter on the error code of the exceptions a catcher handles, for
+   CEXCEPT_TRY_FILTER.  An exception passes the filter if the bit for
+   its error code is set in CODES, or else if PREDICATE is non-NULL and
+   returns non-zero when called with the exception and DATA.  Only
+   codes 0 to 63 can be given in CODES; PREDICATE must not throw.  */
+
+struct cexcept_filter
+{
+  unsigned long long codes;
+  int (*predicate) (const struct cexception *exception, void *data);
+  void *data;
 };
 
+/* The bit for error code ERROR in a filter's CODES.  */
+#define CEXCEPT_ERROR_BIT(ERROR) (1ULL << (ERROR))
+
 /* Wrap set/long jmp so that it's more portable (internal to
-   exceptions).  */
+   exceptions).
+
+   The backend is chosen with configure --with-try-backend, and the
+   library and its users must agree on it:
 
-#ifndef _WIN32
+   sigsetjmp: the default.  Entering a TRY saves the signal mask, so
+   that a throw from a signal handler restores it.
+
+   setjmp: like sigsetjmp, without the signal mask.  This saves a
+   system call on each TRY.
+
+   builtin: GCC's __builtin_setjmp and __builtin_longjmp, which only
+   save the frame and stack pointers and the resume address.  This is
+   the cheapest.  Like setjmp, the signal mask is not restored.  */
+
+#if defined CEXCEPT_TRY_BACKEND_BUILTIN
+typedef void *cexcept_builtin_jmp_buf[5];
+#define CEXCEPT_SIGJMP_BUF cexcept_builtin_jmp_buf
+#define CEXCEPT_SIGSETJMP(buf) __builtin_setjmp (buf)
+#define CEXCEPT_SIGLONGJMP(buf, val) __builtin_longjmp ((buf), 1)
+#elif defined CEXCEPT_TRY_BACKEND_SETJMP
+#define CEXCEPT_SIGJMP_BUF sigjmp_buf
+#define CEXCEPT_SIGSETJMP(buf) sigsetjmp ((buf), 0)
+#define CEXCEPT_SIGLONGJMP(buf, val) siglongjmp ((buf), (val))
+#elif !defined _WIN32
 #define CEXCEPT_SIGJMP_BUF sigjmp_buf
 #define CEXCEPT_SIGSETJMP(buf) sigsetjmp ((buf), 1)
 #define CEXCEPT_SIGLONGJMP(buf, val) siglongjmp ((buf), (val))
@@ -72,6 +117,16 @@ struct cexception
 CEXCEPT_SIGJMP_BUF *cexcept_state_mc_init
   (volatile struct cexception *exception,
    return_mask mask);
+CEXCEPT_SIGJMP_BUF *cexcept_state_mc_init_filter
+  (volatile struct cexception *exception,
+   return_mask mask,
+   const struct cexcept_filter *filter);
+CEXCEPT_SIGJMP_BUF *cexcept_state_mc_init_named
+  (volatile struct cexception *exception,
+   return_mask mask,
+   const char *region);
+CEXCEPT_SIGJMP_BUF *cexcept_state_mc_init_finally
+  (volatile struct cexception *exception);
 int cexcept_state_mc_action_iter (void);
 int cexcept_state_mc_action_iter_1 (void);
 
@@ -106,6 +161,112 @@ int cexcept_state_mc_action_iter_1 (void);
   while (cexcept_state_mc_action_iter ())	       \
     while (cexcept_state_mc_action_iter_1 ())
 
+/* Like CEXCEPT_TRY, but only catch the exceptions that also pass
+   FILTER, a "const struct cexcept_filter *".  Exceptions that do not
+   pass go straight to the next containing catcher, without entering
+   this one.
+
+   For instance:
+
+   static const struct cexcept_filter not_found
+     = { CEXCEPT_ERROR_BIT (NOT_FOUND_ERROR), NULL, NULL };
+   volatile struct cexception e;
+
+   CEXCEPT_TRY_FILTER (e, RETURN_MASK_ERROR, &not_found)
+     {
+     }
+   if (e.reason < 0)
+     {
+       ...  Only NOT_FOUND_ERROR gets here.
+     }
+
+  */
+
+#define CEXCEPT_TRY_FILTER(EXCEPTION, MASK, FILTER)		\
+  {								\
+    CEXCEPT_SIGJMP_BUF *buf =					\
+      cexcept_state_mc_init_filter (&(EXCEPTION), (MASK), (FILTER)); \
+    CEXCEPT_SIGSETJMP (*buf);					\
+  }								\
+  while (cexcept_state_mc_action_iter ())			\
+    while (cexcept_state_mc_action_iter_1 ())
+
+/* Like CEXCEPT_TRY, for a region named REGION, a string constant.
+   While recording is on, the time spent in the block is recorded
+   under that name; see regions.h.  */
+
+#define CEXCEPT_TRY_NAMED(EXCEPTION, MASK, REGION)			\
+  {									\
+    CEXCEPT_SIGJMP_BUF *buf =						\
+      cexcept_state_mc_init_named (&(EXCEPTION), (MASK), (REGION));	\
+    CEXCEPT_SIGSETJMP (*buf);						\
+  }									\
+  while (cexcept_state_mc_action_iter ())				\
+    while (cexcept_state_mc_action_iter_1 ())
+
+/* Code to run after a TRY block however it exits, such as unlocking
+   or restoring state.  Open the TRY block with CEXCEPT_TRY_FINALLY,
+   which catches every exception, and follow it with CEXCEPT_FINALLY and
+   a block.  That block runs inline when the TRY block completes
+   normally and when an exception unwinds it; after an exception, the
+   exception is then thrown again to the next containing catcher.
+   Nothing is allocated.  A CEXCEPT_FINALLY that does not follow a
+   CEXCEPT_TRY_FINALLY block aborts the program the first time it is
+   reached, as a narrower TRY would let some exceptions bypass it.
+
+   For instance:
+
+   volatile struct cexception e;
+
+   pthread_mutex_lock (&lock);
+   CEXCEPT_TRY_FINALLY (e)
+     {
+       ...
+     }
+   CEXCEPT_FINALLY (e)
+     {
+       pthread_mutex_unlock (&lock);
+     }
+
+   "break" and "continue" end the block early, and the exception is
+   still thrown again.  Leaving it with "return" or "goto" would
+   swallow the exception.  It may throw, and then the exception being
+   propagated is dropped.
+
+   CEXCEPT_FINALLY starts with a declaration, which comes after the
+   TRY block's statements.  It needs C99, or GNU C's mixed
+   declarations and code: strict C90, or -Wdeclaration-after-statement,
+   rejects it.  It also cannot follow a label directly, nor be the body
+   of an if, else or loop without braces around the whole construct.  */
+
+#define CEXCEPT_TRY_FINALLY(EXCEPTION)				\
+  {								\
+    CEXCEPT_SIGJMP_BUF *buf =					\
+      cexcept_state_mc_init_finally (&(EXCEPTION));		\
+    CEXCEPT_SIGSETJMP (*buf);					\
+  }								\
+  while (cexcept_state_mc_action_iter ())			\
+    while (cexcept_state_mc_action_iter_1 ())
+
+int cexcept_finally_begin (const volatile struct cexception *exception);
+int cexcept_finally_end (const volatile struct cexception *exception);
+
+#define CEXCEPT_FINALLY_NAME_1(LINE) cexcept_finally_ ## LINE
+#define CEXCEPT_FINALLY_NAME(LINE) CEXCEPT_FINALLY_NAME_1 (LINE)
+
+/* The inner loop runs the block once; a "break" in the block only
+   leaves it, so that cexcept_finally_end still runs.  */
+
+#define CEXCEPT_FINALLY(EXCEPTION)				\
+  int CEXCEPT_FINALLY_NAME (__LINE__);				\
+  for (CEXCEPT_FINALLY_NAME (__LINE__)				\
+	 = cexcept_finally_begin (&(EXCEPTION));		\
+       CEXCEPT_FINALLY_NAME (__LINE__);				\
+       CEXCEPT_FINALLY_NAME (__LINE__)				\
+	 = cexcept_finally_end (&(EXCEPTION)))			\
+    for (; CEXCEPT_FINALLY_NAME (__LINE__) == 1;		\
+	 CEXCEPT_FINALLY_NAME (__LINE__) = 2)
+
 /* *INDENT-ON* */
 
 /* Throw an exception (as described by "struct cexception").  Will
@@ -121,4 +282,34 @@ extern void cexcept_throw_vfatal (const char *fmt, va_list ap)
 extern void cexcept_throw_error (int error, const char *fmt, ...)
      ATTRIBUTE_NORETURN ATTRIBUTE_PRINTF (2, 3);
 
+/* A caught exception's message is only valid until the next exception
+   is thrown from the same depth.  To keep an exception longer, copy it
+   and retain the copy; release it when done.  Both are no-ops for an
+   exception whose message is not reference counted.
+
+   For instance:
+
+   struct cexception saved = e;
+   cexcept_exception_retain (&saved);
+   ...
+   cexcept_exception_release (&saved);  */
+
+extern void cexcept_exception_retain (const struct cexception *exception);
+extern void cexcept_exception_release (const struct cexception *exception);
+
+/* Return the text of EXCEPTION's message.  This is its message,
+   except for an exception thrown by id from the message catalog (see
+   catalog.h), whose text is rendered on the first call.  The text is
+   valid as long as the message is.  */
+
+extern const char *cexcept_exception_message
+  (const volatile struct cexception *exception);
+
+/* Throw EXCEPTION, an exception caught earlier, again.  Unlike
+   cexcept_throw, this keeps the message it was thrown with alive
+   without copying or formatting it again.  */
+
+extern void cexcept_rethrow (struct cexception exception)
+     ATTRIBUTE_NORETURN;
+
 #endif
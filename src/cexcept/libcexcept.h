@@ -20,5 +20,14 @@
 
 #include "cexcept/exceptions.h"
 #include "cexcept/cleanups.h"
+#include "cexcept/context.h"
+#include "cexcept/alloc.h"
+#include "cexcept/buf.h"
+#include "cexcept/catalog.h"
+#include "cexcept/locks.h"
+#include "cexcept/mapfile.h"
+#include "cexcept/profile.h"
+#include "cexcept/recorder.h"
+#include "cexcept/regions.h"
 
 #endif
@@ -0,0 +1,80 @@
+/* Lock-aware unwinding for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_LOCKS_H
+#define CEXCEPT_LOCKS_H
+
+#include <pthread.h>
+
+/* The most mutexes a thread may hold through cexcept_lock at once.  */
+#define CEXCEPT_LOCKS_MAX 16
+
+/* Lock MUTEX, and note it as held by the calling thread, in a fixed
+   array rather than on the cleanup chain, so that locking allocates
+   nothing.  If an exception is thrown past the TRY block the lock was
+   taken in, the mutex is unlocked once the cleanups made in that block
+   have been done; locks taken in the same block are unlocked newest
+   first.  A lock still held when its TRY block exits normally belongs
+   to the enclosing block from then on.
+
+   Return zero, or EOWNERDEAD if MUTEX is a robust mutex whose owner
+   died holding it.  MUTEX is then held and noted like any other, and
+   the caller must repair the state it protects and call
+   pthread_mutex_consistent before anything can throw: if an exception
+   unlocks it first, the mutex becomes permanently unusable, as the
+   state was not repaired.
+
+   If the calling thread already holds CEXCEPT_LOCKS_MAX locks, or
+   pthread_mutex_lock fails otherwise, an error is thrown whose code is
+   the negated errno value, -ENOLCK in the first case; MUTEX is not
+   held then.  A lock released out of order, while a TRY block entered
+   after it was taken is running, keeps its place in the array until
+   that block is left.  */
+extern int cexcept_lock (pthread_mutex_t *mutex);
+
+/* Unlock MUTEX, which the calling thread locked with cexcept_lock.
+   Locks need not be released in the order they were taken, nor in the
+   TRY block they were taken in.  */
+extern void cexcept_unlock (pthread_mutex_t *mutex);
+
+/* While accounting is on, cexcept_lock counts the locks it found
+   taken by another thread, and times how long it waited for them and
+   how long each lock taken then is held.  Turn it on if ENABLE is
+   non-zero, off otherwise.  Return whether it was on.  */
+extern int cexcept_set_lock_accounting (int enable);
+
+/* Counts of the calling thread's locks since it started or its counts
+   were last reset.  UNWOUND counts the locks released by an exception
+   rather than by cexcept_unlock, and UNWOUND_HOLD_NS the part of
+   HOLD_NS they account for.  The times and CONTENDED only cover locks
+   taken while accounting was on.  */
+
+struct cexcept_lock_stats
+{
+  unsigned long acquired;
+  unsigned long contended;
+  unsigned long unwound;
+  unsigned long long wait_ns;
+  unsigned long long hold_ns;
+  unsigned long long max_hold_ns;
+  unsigned long long unwound_hold_ns;
+};
+
+extern void cexcept_get_lock_stats (struct cexcept_lock_stats *stats);
+extern void cexcept_reset_lock_stats (void);
+
+#endif /* CEXCEPT_LOCKS_H */
@@ -0,0 +1,52 @@
+/* Memory-mapped file reading for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_MAPFILE_H
+#define CEXCEPT_MAPFILE_H
+
+#include <stddef.h>
+
+/* Map the file PATH read-only, store its size in *LEN, and return the
+   address of its contents.  The mapping is advised for sequential
+   access, and for huge pages where the system supports them for
+   files.  A cleanup that unmaps it is added to the cleanup chain.  An
+   empty file is not mapped: NULL is returned, and no cleanup is
+   added.
+
+   On failure, an error is thrown whose code is the negated errno
+   value, such as -ENOENT.
+
+   If the file is truncated while mapped, reading past its new end
+   would raise SIGBUS.  While the mapping is on the cleanup chain, the
+   signal is turned into an error with code -EIO instead, thrown from
+   the reading code.  That only happens in the thread that mapped the
+   file, and within a TRY block: a fault in another thread, or outside
+   any TRY block, is not caught.  Nor is one in a mapping made while
+   256 mappings are already covered, which are not registered with the
+   handler.  Such faults, and other SIGBUS signals, go to the handler
+   installed before the first call, or kill the process as usual.
+
+   The error is thrown from a signal handler, in the middle of whatever
+   read the mapping.  Only read the mapped data directly, in code of
+   your own that can be left by an exception at any access; do not
+   pass it to libc functions such as fwrite, fputs or qsort, which
+   may hold locks or leave state half-updated when they are left that
+   way.  Copy the data out first if they need it.  */
+
+extern const void *cexcept_map_file (const char *path, size_t *len);
+
+#endif /* CEXCEPT_MAPFILE_H */
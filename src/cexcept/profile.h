@@ -0,0 +1,46 @@
+/* Unwind cost profiling for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_PROFILE_H
+#define CEXCEPT_PROFILE_H
+
+#include <stdio.h>
+
+/* When the library is configured with --enable-profiling, every throw
+   and every cleanup invocation is timed, and the time is aggregated
+   by throw site and by cleanup function.  Otherwise these functions
+   do nothing.
+
+   The report is in the "folded stacks" format understood by
+   flamegraph.pl and similar tools: one line per stack, frames
+   separated by ';', followed by the self time in nanoseconds, sorted
+   by decreasing time.  A throw's own frame is named after the throw
+   site, with children for message formatting ("format"), each
+   cleanup function run while unwinding, and the long jump to the
+   handler ("longjmp").  Cleanups run outside a throw appear under
+   "cexcept_do_cleanups".
+
+   If the CEXCEPT_PROFILE environment variable names a file, the
+   report is written there when the program exits.  */
+
+/* Write the report to STREAM.  */
+extern void cexcept_profile_dump (FILE *stream);
+
+/* Forget everything recorded so far.  */
+extern void cexcept_profile_reset (void);
+
+#endif /* CEXCEPT_PROFILE_H */
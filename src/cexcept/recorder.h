@@ -0,0 +1,44 @@
+/* Exception flight recorder for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_RECORDER_H
+#define CEXCEPT_RECORDER_H
+
+/* The flight recorder keeps the last exceptions thrown by each thread
+   (time, reason, error, catcher depth, throw address and the start of
+   the message) in a file mapped in memory.  Recording a throw makes
+   no system calls; the records reach the file through the page cache
+   even if the process crashes.  Decode the file with cexcept-dump,
+   either while the process runs or afterwards.  */
+
+/* Start recording to the file PATH, which is created or truncated.
+   Each of up to THREADS throwing threads gets a ring of the last
+   RECORDS exceptions; RECORDS is rounded up to a power of two.
+   Returns 0 on success, or a negative errno value: -EINVAL if RECORDS
+   or THREADS is zero, RECORDS is over 2^24, or the file would be too
+   large.  If recording was already on, the previous file is closed as
+   by cexcept_recorder_close, so this must not race with throws in
+   other threads then either.  */
+extern int cexcept_recorder_open (const char *path,
+				  unsigned int records,
+				  unsigned int threads);
+
+/* Stop recording and unmap the file, which is left in place.  This
+   must not race with throws in other threads.  */
+extern void cexcept_recorder_close (void);
+
+#endif /* CEXCEPT_RECORDER_H */
@@ -0,0 +1,86 @@
+/* Latency of named TRY regions for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#ifndef CEXCEPT_REGIONS_H
+#define CEXCEPT_REGIONS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* While recording is on, each TRY block entered with
+   CEXCEPT_TRY_NAMED is timed from entry to exit, and the time goes
+   into a histogram of its region, one for exits without an exception
+   and one for exits by an exception, whether the block caught it or
+   let it through.  Each thread records into histograms of its own,
+   without locking; a snapshot merges those of all threads, including
+   threads that have exited, by region name.
+
+   The histograms are log-linear: values under 16 ns are exact, and
+   above that each power of two is split into 16 buckets, for a
+   precision of about 6%, up to 2^41 ns.
+
+   When recording is off, as it is by default, a named TRY costs one
+   branch over a plain one.  */
+
+/* Turn recording on if ENABLE is non-zero, off otherwise.  Return
+   whether it was on.  */
+extern int cexcept_set_region_recording (int enable);
+
+#define CEXCEPT_REGION_BUCKETS 608
+
+/* How a region was left.  */
+enum cexcept_region_exit
+{
+  CEXCEPT_REGION_NORMAL,
+  CEXCEPT_REGION_EXCEPTION,
+  CEXCEPT_REGION_EXITS
+};
+
+struct cexcept_region_histogram
+{
+  unsigned long count;
+  unsigned long long total_ns;
+  unsigned long long max_ns;
+  unsigned long buckets[CEXCEPT_REGION_BUCKETS];
+};
+
+struct cexcept_region_stats
+{
+  const char *name;
+  struct cexcept_region_histogram exits[CEXCEPT_REGION_EXITS];
+};
+
+/* Return the merged histograms of every region recorded so far, and
+   store their number in *COUNT.  A thread records at most 64 regions,
+   and a snapshot holds at most 64; the exits of the regions past that
+   are dropped, and their number is stored in *DROPPED unless it is
+   NULL.  Threads still recording may have their last few exits only
+   partly counted.  Release the result with
+   cexcept_region_snapshot_free.  */
+extern struct cexcept_region_stats *cexcept_region_snapshot
+  (size_t *count, unsigned long *dropped);
+extern void cexcept_region_snapshot_free (struct cexcept_region_stats *stats);
+
+/* Return the time under which PERCENTILE percent of the exits in
+   HISTOGRAM took, within the precision of its buckets.  */
+extern unsigned long long cexcept_region_percentile
+  (const struct cexcept_region_histogram *histogram, double percentile);
+
+/* Write a table of the regions recorded so far to STREAM.  */
+extern void cexcept_region_dump (FILE *stream);
+
+#endif /* CEXCEPT_REGIONS_H */
@@ -30,20 +30,73 @@
    If the argument is pointer to allocated memory, then you need
    to additionally set the 'free_arg' member to a function that will
    free that memory.  This function will be called both when the cleanup
-   is executed and when it's discarded.  */
+   is executed and when it's discarded.
 
+   Each link also points back at the newer link above it, and the
+   newest link at the oldest one of its chain, so that a run of
+   cleanups can be moved to another chain in constant time with
+   transfer_cleanups.
+
+   A cleanup whose argument is small can keep a copy of it at the end
+   of its own link, made with make_cleanup_inline, so that the argument
+   needs no allocation or destructor of its own.
+
+   The function of a deferred cleanup, made with make_cleanup_deferred,
+   is not called when the cleanup is done: the cleanup is queued
+   instead, for a background thread to call it, see deferred.c.
+
+   make_undo saves bytes of memory in a journal, see undo.c, to be
+   copied back if the cleanup is done.  Consecutive undo records share
+   a single cleanup, and take their memory from an arena, so that
+   discarding them costs the same however many there are.
+
+   Closing descriptors and streams, freeing memory and unmapping
+   regions are common enough to have built-in cleanups.  Consecutive
+   cleanups of one of these kinds are performed as a batch, which
+   saves the indirect calls and lets several system calls be merged
+   into one.  */
+
+#include "exceptions.h"
 #include "cleanups.h"
 #include "libcexcept-private.h"
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 struct cexcept_cleanup
 {
   struct cexcept_cleanup *next;
+  /* The cleanup made right after this one on the same chain, or NULL
+     if this is the newest.  */
+  struct cexcept_cleanup *prev;
+  /* The oldest cleanup of the chain.  Only kept right for the newest
+     cleanup of a chain; see uncover_cleanup.  */
+  struct cexcept_cleanup *base;
   void (*function) (void *);
   void (*free_arg) (void *);
   void *arg;
+  /* The size of INLINE_ARG, for inline cleanups.  */
+  size_t size;
+#ifdef ENABLE_LEAK_CHECK
+  /* Where the cleanup was made.  */
+  const void *site;
+#endif
+  /* The copy of the argument of an inline cleanup, which ARG points
+     to.  Only as large as the copy.  Aligned no more strictly than the
+     fields above, so that it adds no padding to other cleanups.  */
+  union
+  {
+    void *p;
+    long long ll;
+    char bytes[1];
+  } inline_arg[];
 };
 
 /* Used to mark the end of a cleanup chain.
@@ -56,19 +109,124 @@ struct cexcept_cleanup
    This is const for a bit of extra robustness.
    It is initialized to coax gcc into putting it into .rodata.
    All fields are initialized to survive -Wextra.  */
-static const struct cexcept_cleanup sentinel_cleanup = { 0, 0, 0, 0 };
+static const struct cexcept_cleanup sentinel_cleanup
+  = { 0, 0, 0, 0, 0, 0, 0 };
 
 /* Handy macro to use when referring to sentinel_cleanup.  */
 #define SENTINEL_CLEANUP ((struct cexcept_cleanup *) &sentinel_cleanup)
 
 /* Chain of cleanup actions established with make_cleanup,
-   to be executed if an error happens.  */
-static struct cexcept_cleanup *cleanup_chain = SENTINEL_CLEANUP;
+   to be executed if an error happens.  Each thread has its own.  */
+static CEXCEPT_THREAD struct cexcept_cleanup *cleanup_chain = SENTINEL_CLEANUP;
 
 /* Chain of cleanup actions established with make_final_cleanup,
-   to be executed when gdb exits.  */
+   to be executed when gdb exits.  It is shared by all threads, which
+   push on it with push_final_cleanups and take cleanups off it with
+   detach_final_cleanups, both lock-free.  The PREV and BASE links of
+   its cleanups are not maintained.  */
 static struct cexcept_cleanup *final_cleanup_chain = SENTINEL_CLEANUP;
 
+/* Chain of cleanup actions established with make_thread_final_cleanup,
+   to be executed when the thread exits.  */
+static CEXCEPT_THREAD struct cexcept_cleanup *thread_final_cleanup_chain
+  = SENTINEL_CLEANUP;
+
+/* This thread's cleanups: how many there are, on any chain, and how
+   much memory they take.  */
+static CEXCEPT_THREAD struct cexcept_cleanup_stats cleanup_stats;
+
+/* The memory taken by cleanup C.  */
+
+static size_t
+cleanup_bytes (const struct cexcept_cleanup *c)
+{
+  if (c->arg == (const void *) c->inline_arg)
+    return offsetof (struct cexcept_cleanup, inline_arg) + c->size;
+  return sizeof (struct cexcept_cleanup);
+}
+
+/* Account for cleanup C leaving its chain, to be freed.  */
+
+static void
+note_cleanup_gone (const struct cexcept_cleanup *c)
+{
+  cleanup_stats.count--;
+  cleanup_stats.bytes -= cleanup_bytes (c);
+}
+
+/* Account for cleanup C, just made.  */
+
+static void
+note_cleanup_made (const struct cexcept_cleanup *c)
+{
+  cleanup_stats.count++;
+  cleanup_stats.bytes += cleanup_bytes (c);
+  if (cleanup_stats.count > cleanup_stats.peak_count)
+    cleanup_stats.peak_count = cleanup_stats.count;
+  if (cleanup_stats.bytes > cleanup_stats.peak_bytes)
+    cleanup_stats.peak_bytes = cleanup_stats.bytes;
+}
+
+/* In each of the public functions that make a cleanup, record the
+   caller as the place cleanup C was made.  */
+
+#ifdef ENABLE_LEAK_CHECK
+#define note_cleanup_site(C) ((C)->site = __builtin_return_address (0))
+#else
+#define note_cleanup_site(C) do { } while (0)
+#endif
+
+/* Make OLD_CHAIN, from which the cleanups above have just been taken,
+   the newest cleanup of its chain, whose oldest is BASE.  The links
+   below the newest are not updated when cleanups are moved between
+   chains, as that would take time in the length of the run; instead,
+   the newest hands its BASE down whenever it is taken off.  */
+
+static void
+uncover_cleanup (struct cexcept_cleanup *old_chain,
+		 struct cexcept_cleanup *base)
+{
+  if (old_chain != SENTINEL_CLEANUP)
+    {
+      old_chain->prev = NULL;
+      old_chain->base = base;
+    }
+}
+
+/* Push NEW, a newly allocated cleanup, on *PMY_CHAIN, and fill it in
+   with FUNCTION, ARG and FREE_ARG as for make_my_cleanup2, and SIZE.  */
+
+static struct cexcept_cleanup *
+push_my_cleanup (struct cexcept_cleanup **pmy_chain,
+		 struct cexcept_cleanup *new,
+		 cexcept_make_cleanup_ftype *function,
+		 void *arg,  void (*free_arg) (void *), size_t size)
+{
+  struct cexcept_cleanup *old_chain = *pmy_chain;
+
+  new->next = old_chain;
+  new->prev = NULL;
+  if (old_chain != SENTINEL_CLEANUP)
+    {
+      old_chain->prev = new;
+      new->base = old_chain->base;
+    }
+  else
+    new->base = new;
+  new->function = function;
+  new->free_arg = free_arg;
+  new->arg = arg;
+  new->size = size;
+#ifdef ENABLE_LEAK_CHECK
+  new->site = NULL;
+#endif
+  *pmy_chain = new;
+  note_cleanup_made (new);
+
+  assert (old_chain != NULL);
+  return old_chain;
+}
+
 /* Main worker routine to create a cleanup.
    PMY_CHAIN is a pointer to either cleanup_chain or final_cleanup_chain.
    FUNCTION is the function to call to perform the cleanup.
@@ -83,18 +241,8 @@ make_my_cleanup2 (struct cexcept_cleanup **pmy_chain,
 		  cexcept_make_cleanup_ftype *function,
 		  void *arg,  void (*free_arg) (void *))
 {
-  struct cexcept_cleanup *new
-    = (struct cexcept_cleanup *) malloc (sizeof (struct cexcept_cleanup));
-  struct cexcept_cleanup *old_chain = *pmy_chain;
-
-  new->next = *pmy_chain;
-  new->function = function;
-  new->free_arg = free_arg;
-  new->arg = arg;
-  *pmy_chain = new;
-
-  assert (old_chain != NULL);
-  return old_chain;
+  return push_my_cleanup (pmy_chain, XNEW (struct cexcept_cleanup),
+			  function, arg, free_arg, 0);
 }
 
 /* Worker routine to create a cleanup without a destructor.
@@ -121,7 +269,11 @@ make_my_cleanup (struct cexcept_cleanup **pmy_chain,
 CEXCEPT_EXPORT struct cexcept_cleanup *
 cexcept_make_cleanup (cexcept_make_cleanup_ftype *function, void *arg)
 {
-  return make_my_cleanup (&cleanup_chain, function, arg);
+  struct cexcept_cleanup *old_chain
+    = make_my_cleanup (&cleanup_chain, function, arg);
+
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
 }
 
 /* Same as make_cleanup except also includes TDOR, a destructor to free ARG.
@@ -131,37 +283,561 @@ CEXCEPT_EXPORT struct cexcept_cleanup *
 cexcept_make_cleanup_dtor (cexcept_make_cleanup_ftype *function, void *arg,
 		   void (*dtor) (void *))
 {
-  return make_my_cleanup2 (&cleanup_chain,
-			   function, arg, dtor);
+  struct cexcept_cleanup *old_chain
+    = make_my_cleanup2 (&cleanup_chain, function, arg, dtor);
+
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
 }
 
-/* Same as make_cleanup except the cleanup is added to final_cleanup_chain.  */
+/* Worker routine to create a cleanup whose argument is a copy of the
+   SIZE bytes at ARG, kept in the cleanup itself.  FREE_ARG is as for
+   make_my_cleanup2.  */
+
+static struct cexcept_cleanup *
+make_inline_cleanup (cexcept_make_cleanup_ftype *function,
+		     const void *arg, size_t size, void (*free_arg) (void *))
+{
+  struct cexcept_cleanup *new;
+
+  if (size > CEXCEPT_CLEANUP_INLINE_MAX)
+    cexcept_throw_error (-EINVAL, "inline cleanup argument of %zu bytes,"
+			 " more than %d", size, CEXCEPT_CLEANUP_INLINE_MAX);
+
+  new = cexcept_xmalloc (offsetof (struct cexcept_cleanup, inline_arg)
+			 + size);
+  memcpy (new->inline_arg, arg, size);
+  return push_my_cleanup (&cleanup_chain, new, function, new->inline_arg,
+			  free_arg, size);
+}
+
+/* Same as make_cleanup except ARG points to SIZE bytes, at most
+   CEXCEPT_CLEANUP_INLINE_MAX, which are copied into the cleanup
+   itself.  FUNCTION is passed a pointer to the copy, which lives as
+   long as the cleanup.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_cleanup_inline (cexcept_make_cleanup_ftype *function,
+			     const void *arg, size_t size)
+{
+  struct cexcept_cleanup *old_chain
+    = make_inline_cleanup (function, arg, size, NULL);
+
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
+}
+
+/* Return the argument of the newest cleanup on the cleanup_chain; for
+   an inline cleanup, its copy, which the caller may update.  */
+
+void *
+cexcept_newest_cleanup_arg (void)
+{
+  assert (cleanup_chain != SENTINEL_CLEANUP);
+  return cleanup_chain->arg;
+}
+
+/* The function of deferred cleanups.  do_my_cleanups hands them over
+   to the reclaimer instead of calling this.  */
+
+static void
+deferred_cleanup (void *arg)
+{
+  struct cexcept_deferred *work = arg;
+
+  (*work->function) (work->arg);
+}
+
+/* Same as make_cleanup, except that when the cleanup is done, FUNCTION
+   is called later, from the reclaimer thread.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_cleanup_deferred (cexcept_make_cleanup_ftype *function,
+			       void *arg)
+{
+  struct cexcept_cleanup *old_chain;
+  struct cexcept_deferred work;
+
+  work.next = NULL;
+  work.function = function;
+  work.arg = arg;
+  work.storage = NULL;
+  old_chain = cexcept_make_cleanup_inline (deferred_cleanup, &work,
+					   sizeof (work));
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
+}
+
+/* Save the SIZE bytes at PTR in the undo journal, to be copied back
+   if the cleanup is done.  If the newest cleanup on the chain is
+   already an undo cleanup, the bytes are added to its run, and the
+   chain it was made on is returned again.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_undo (void *ptr, size_t size)
+{
+  struct cexcept_cleanup *old_chain;
+
+  if (cleanup_chain->function == cexcept_undo_restore)
+    old_chain = cleanup_chain->next;
+  else
+    {
+      struct cexcept_undo journal;
+
+      cexcept_undo_open (&journal);
+      old_chain = make_inline_cleanup (cexcept_undo_restore, &journal,
+				       sizeof (journal),
+				       cexcept_undo_release);
+      note_cleanup_site (cleanup_chain);
+    }
+
+  cexcept_undo_record (cleanup_chain->arg, ptr, size);
+  return old_chain;
+}
+
+/* Same as make_cleanup_dtor, except also stores a handle on the new
+   cleanup in *HANDLE, to be passed later to cancel_cleanup.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_cancelable_cleanup (cexcept_make_cleanup_ftype *function,
+				 void *arg, void (*dtor) (void *),
+				 struct cexcept_cleanup **handle)
+{
+  struct cexcept_cleanup *old_chain
+    = make_my_cleanup2 (&cleanup_chain, function, arg, dtor);
+
+  note_cleanup_site (cleanup_chain);
+  *handle = cleanup_chain;
+  return old_chain;
+}
+
+/* Disarm the cleanup HANDLE refers to, leaving the rest of the chain
+   alone.  Its destructor runs now, as if it had been discarded.  If it
+   is the newest cleanup, it is taken off the chain and freed; otherwise
+   the record stays on the chain as a no-op until the chain is done or
+   discarded past it.  Either way this is constant time.  */
+
+CEXCEPT_EXPORT void
+cexcept_cancel_cleanup (struct cexcept_cleanup *handle)
+{
+  void (*free_arg) (void *) = handle->free_arg;
+
+  if (handle == cleanup_chain)
+    {
+      cleanup_chain = handle->next;
+      note_cleanup_gone (handle);
+      uncover_cleanup (handle->next, handle->base);
+      if (free_arg)
+	(*free_arg) (handle->arg);
+      cexcept_xfree (handle);
+      return;
+    }
+
+  handle->function = cexcept_null_cleanup;
+  handle->free_arg = NULL;
+  if (free_arg)
+    (*free_arg) (handle->arg);
+}
+
+/* Push the run of cleanups from TOP down to BOTTOM, linked through
+   their NEXT fields, on final_cleanup_chain.  Return the cleanup they
+   were pushed above.  */
+
+static struct cexcept_cleanup *
+push_final_cleanups (struct cexcept_cleanup *top,
+		     struct cexcept_cleanup *bottom)
+{
+  struct cexcept_cleanup *head
+    = __atomic_load_n (&final_cleanup_chain, __ATOMIC_RELAXED);
+
+  do
+    bottom->next = head;
+  while (!__atomic_compare_exchange_n (&final_cleanup_chain, &head, top, 1,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return head;
+}
+
+/* Take the cleanups above OLD_CHAIN off final_cleanup_chain, and
+   return the newest of them; they stay linked down to OLD_CHAIN.
+   Cleanups pushed meanwhile by other threads are taken too.  */
+
+static struct cexcept_cleanup *
+detach_final_cleanups (struct cexcept_cleanup *old_chain)
+{
+  struct cexcept_cleanup *head
+    = __atomic_load_n (&final_cleanup_chain, __ATOMIC_ACQUIRE);
+
+  while (head != old_chain
+	 && !__atomic_compare_exchange_n (&final_cleanup_chain, &head,
+					  old_chain, 1, __ATOMIC_ACQUIRE,
+					  __ATOMIC_ACQUIRE))
+    ;
+  return head;
+}
+
+/* Same as make_cleanup except the cleanup is added to final_cleanup_chain.
+   This may be called from any thread.  */
 
 CEXCEPT_EXPORT struct cexcept_cleanup *
 cexcept_make_final_cleanup (cexcept_make_cleanup_ftype *function, void *arg)
 {
-  return make_my_cleanup (&final_cleanup_chain, function, arg);
+  struct cexcept_cleanup *new = XNEW (struct cexcept_cleanup);
+
+  new->prev = NULL;
+  new->base = new;
+  new->function = function;
+  new->free_arg = NULL;
+  new->arg = arg;
+  new->size = 0;
+  note_cleanup_site (new);
+  return push_final_cleanups (new, new);
+}
+
+/* The key whose destructor runs the thread final cleanups.  Its value
+   is non-NULL in the threads that have made some.  */
+static pthread_key_t thread_final_key;
+static pthread_once_t thread_final_once = PTHREAD_ONCE_INIT;
+
+static void
+run_thread_final_cleanups (void *value)
+{
+  cexcept_do_thread_final_cleanups (SENTINEL_CLEANUP);
+}
+
+static void
+create_thread_final_key (void)
+{
+  if (pthread_key_create (&thread_final_key, run_thread_final_cleanups)
+      != 0)
+    abort ();
+}
+
+/* Same as make_cleanup except the cleanup is added to the calling
+   thread's thread_final_cleanup_chain, which is done when the thread
+   exits.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_thread_final_cleanup (cexcept_make_cleanup_ftype *function,
+				   void *arg)
+{
+  struct cexcept_cleanup *old_chain;
+
+  pthread_once (&thread_final_once, create_thread_final_key);
+  if (thread_final_cleanup_chain == SENTINEL_CLEANUP)
+    pthread_setspecific (thread_final_key, &thread_final_cleanup_chain);
+
+  old_chain = make_my_cleanup (&thread_final_cleanup_chain, function, arg);
+  note_cleanup_site (thread_final_cleanup_chain);
+  return old_chain;
+}
+
+/* The functions of the built-in cleanups.  They identify the built-in
+   cleanups, which do_my_cleanups hands over to do_cleanup_batch
+   instead of calling the function, but each still does the right
+   thing for a single cleanup.  */
+
+static void
+close_cleanup (void *arg)
+{
+  close ((int) (intptr_t) arg);
+}
+
+static void
+fclose_cleanup (void *arg)
+{
+  fclose ((FILE *) arg);
+}
+
+static void
+free_cleanup (void *arg)
+{
+  free (arg);
+}
+
+/* A region to unmap, the inline argument of an unmapping cleanup.  */
+
+struct mapping
+{
+  char *addr;
+  size_t len;
+};
+
+static void
+munmap_cleanup (void *arg)
+{
+  struct mapping *mapping = arg;
+
+  munmap (mapping->addr, mapping->len);
+}
+
+/* Add a built-in cleanup calling FUNCTION on ARG to the cleanup_chain,
+   and return the previous chain pointer.  */
+
+static struct cexcept_cleanup *
+make_builtin_cleanup (cexcept_make_cleanup_ftype *function, void *arg)
+{
+  return push_my_cleanup (&cleanup_chain, XNEW (struct cexcept_cleanup),
+			  function, arg, NULL, 0);
+}
+
+/* Add a cleanup that closes the file descriptor FD.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_cleanup_close (int fd)
+{
+  struct cexcept_cleanup *old_chain
+    = make_builtin_cleanup (close_cleanup, (void *) (intptr_t) fd);
+
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
+}
+
+/* Add a cleanup that closes the stream FILE.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_cleanup_fclose (FILE *file)
+{
+  struct cexcept_cleanup *old_chain
+    = make_builtin_cleanup (fclose_cleanup, file);
+
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
+}
+
+/* Add a cleanup that frees PTR, allocated with malloc.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_cleanup_free (void *ptr)
+{
+  struct cexcept_cleanup *old_chain
+    = make_builtin_cleanup (free_cleanup, ptr);
+
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
+}
+
+/* Add a cleanup that unmaps the LEN bytes mapped at ADDR.  */
+
+CEXCEPT_EXPORT struct cexcept_cleanup *
+cexcept_make_cleanup_munmap (void *addr, size_t len)
+{
+  struct mapping mapping;
+  struct cexcept_cleanup *old_chain;
+
+  mapping.addr = addr;
+  mapping.len = len;
+  old_chain = make_inline_cleanup (munmap_cleanup, &mapping,
+				   sizeof (mapping), NULL);
+
+  note_cleanup_site (cleanup_chain);
+  return old_chain;
+}
+
+static int
+builtin_cleanup_p (cexcept_make_cleanup_ftype *function)
+{
+  return (function == close_cleanup
+	  || function == fclose_cleanup
+	  || function == free_cleanup
+	  || function == munmap_cleanup);
+}
+
+/* The most built-in cleanups performed as one batch.  */
+#define CLEANUP_BATCH_SIZE 64
+
+/* A run of consecutive built-in cleanups with the same function.  */
+
+struct cleanup_batch
+{
+  cexcept_make_cleanup_ftype *function;
+  int count;
+  struct cexcept_cleanup *cleanups[CLEANUP_BATCH_SIZE];
+};
+
+static int
+compare_fds (const void *a, const void *b)
+{
+  int fa = *(const int *) a;
+  int fb = *(const int *) b;
+
+  return (fa > fb) - (fa < fb);
+}
+
+/* Close the COUNT descriptors in FDS, which is reordered.  Runs of
+   consecutive descriptors are closed with a single close_range call
+   where available.  */
+
+static void
+close_fds (int *fds, int count)
+{
+  int i, j;
+
+  qsort (fds, count, sizeof (int), compare_fds);
+
+  for (i = 0; i < count; i = j)
+    {
+      /* Find the end of the run starting at I, skipping duplicates.  */
+      for (j = i + 1;
+	   j < count && (fds[j] == fds[j - 1] || fds[j] == fds[j - 1] + 1);
+	   j++)
+	;
+
+#ifdef HAVE_CLOSE_RANGE
+      if (j - i > 1
+	  && close_range (fds[i], fds[j - 1], 0) == 0)
+	continue;
+#endif
+      {
+	int k;
+
+	for (k = i; k < j; k++)
+	  if (k == i || fds[k] != fds[k - 1])
+	    close (fds[k]);
+      }
+    }
+}
+
+static int
+compare_mappings (const void *a, const void *b)
+{
+  const struct mapping *ma = a;
+  const struct mapping *mb = b;
+
+  return (ma->addr > mb->addr) - (ma->addr < mb->addr);
+}
+
+/* Unmap the COUNT regions in MAPPINGS, which is reordered.  Adjacent
+   regions are unmapped with a single munmap call.  */
+
+static void
+unmap_regions (struct mapping *mappings, int count)
+{
+  size_t page_mask = sysconf (_SC_PAGESIZE) - 1;
+  int i, j;
+
+  /* munmap works on whole pages.  */
+  for (i = 0; i < count; i++)
+    mappings[i].len = (mappings[i].len + page_mask) & ~page_mask;
+
+  qsort (mappings, count, sizeof (struct mapping), compare_mappings);
+
+  for (i = 0; i < count; i = j)
+    {
+      char *end = mappings[i].addr + mappings[i].len;
+
+      for (j = i + 1; j < count && mappings[j].addr == end; j++)
+	end += mappings[j].len;
+      munmap (mappings[i].addr, end - mappings[i].addr);
+    }
+}
+
+/* Perform the cleanups in the batch ARG, a struct cleanup_batch.  */
+
+static void
+run_cleanup_batch (void *arg)
+{
+  struct cleanup_batch *batch = arg;
+  int i;
+
+  if (batch->function == close_cleanup)
+    {
+      int fds[CLEANUP_BATCH_SIZE];
+
+      for (i = 0; i < batch->count; i++)
+	fds[i] = (int) (intptr_t) batch->cleanups[i]->arg;
+      close_fds (fds, batch->count);
+    }
+  else if (batch->function == munmap_cleanup)
+    {
+      struct mapping mappings[CLEANUP_BATCH_SIZE];
+
+      for (i = 0; i < batch->count; i++)
+	mappings[i] = *(struct mapping *) batch->cleanups[i]->arg;
+      unmap_regions (mappings, batch->count);
+    }
+  else
+    {
+      /* Streams are closed, and memory freed, newest first, as they
+	 would have been one by one.  */
+      for (i = 0; i < batch->count; i++)
+	if (batch->function == fclose_cleanup)
+	  fclose ((FILE *) batch->cleanups[i]->arg);
+	else
+	  free (batch->cleanups[i]->arg);
+    }
+}
+
+/* Perform the run of built-in cleanups at the head of *PMY_CHAIN that
+   share the head's function, stopping at OLD_CHAIN.  COUNTED is as for
+   do_my_cleanups.  */
+
+static void
+do_cleanup_batch (struct cexcept_cleanup **pmy_chain,
+		  struct cexcept_cleanup *old_chain, int counted)
+{
+  struct cleanup_batch batch;
+  struct cexcept_cleanup *ptr;
+  int i;
+
+  batch.function = (*pmy_chain)->function;
+  batch.count = 0;
+  while ((ptr = *pmy_chain) != old_chain
+	 && ptr->function == batch.function
+	 && batch.count < CLEANUP_BATCH_SIZE)
+    {
+      *pmy_chain = ptr->next;
+      if (counted)
+	note_cleanup_gone (ptr);
+      batch.cleanups[batch.count++] = ptr;
+    }
+
+  cexcept_profile_call_cleanup (run_cleanup_batch, &batch);
+
+  for (i = 0; i < batch.count; i++)
+    cexcept_xfree (batch.cleanups[i]);
 }
 
 /* Worker routine to perform cleanups.
    PMY_CHAIN is a pointer to either cleanup_chain or final_cleanup_chain.
    OLD_CHAIN is the result of a "make" cleanup routine.
+   COUNTED is zero for the final cleanup chain, whose cleanups are not
+   in any thread's cleanup_stats.
    Cleanups are performed until we get back to the old end of the chain.  */
 
 static void
 do_my_cleanups (struct cexcept_cleanup **pmy_chain,
-		struct cexcept_cleanup *old_chain)
+		struct cexcept_cleanup *old_chain, int counted)
 {
+  struct cexcept_cleanup *base = (*pmy_chain)->base;
   struct cexcept_cleanup *ptr;
 
   while ((ptr = *pmy_chain) != old_chain)
     {
+      if (builtin_cleanup_p (ptr->function))
+	{
+	  do_cleanup_batch (pmy_chain, old_chain, counted);
+	  continue;
+	}
+
       *pmy_chain = ptr->next;	/* Do this first in case of recursion.  */
-      (*ptr->function) (ptr->arg);
+      if (counted)
+	note_cleanup_gone (ptr);
+      if (ptr->function == deferred_cleanup)
+	{
+	  struct cexcept_deferred *work = ptr->arg;
+
+	  /* The reclaimer frees the cleanup along with the work.  */
+	  work->storage = ptr;
+	  cexcept_defer (work);
+	  continue;
+	}
+      cexcept_profile_call_cleanup (ptr->function, ptr->arg);
       if (ptr->free_arg)
 	(*ptr->free_arg) (ptr->arg);
-      free (ptr);
+      cexcept_xfree (ptr);
     }
+
+  uncover_cleanup (old_chain, base);
 }
 
 /* Return a value that can be passed to do_cleanups, do_final_cleanups to
@@ -179,7 +855,7 @@ cexcept_all_cleanups (void)
 CEXCEPT_EXPORT void
 cexcept_do_cleanups (struct cexcept_cleanup *old_chain)
 {
-  do_my_cleanups (&cleanup_chain, old_chain);
+  do_my_cleanups (&cleanup_chain, old_chain, 1);
 }
 
 /* Discard cleanups and do the actions they describe
@@ -188,27 +864,48 @@ cexcept_do_cleanups (struct cexcept_cleanup *old_chain)
 CEXCEPT_EXPORT void
 cexcept_do_final_cleanups (struct cexcept_cleanup *old_chain)
 {
-  do_my_cleanups (&final_cleanup_chain, old_chain);
+  struct cexcept_cleanup *chain;
+
+  /* The cleanups may make final cleanups of their own, which are done
+     too.  */
+  while ((chain = detach_final_cleanups (old_chain)) != old_chain)
+    do_my_cleanups (&chain, old_chain, 0);
+}
+
+/* Discard cleanups and do the actions they describe
+   until we get back to the point OLD_CHAIN in the calling thread's
+   thread_final_cleanup_chain.  */
+
+CEXCEPT_EXPORT void
+cexcept_do_thread_final_cleanups (struct cexcept_cleanup *old_chain)
+{
+  do_my_cleanups (&thread_final_cleanup_chain, old_chain, 1);
 }
 
 /* Main worker routine to discard cleanups.
    PMY_CHAIN is a pointer to either cleanup_chain or final_cleanup_chain.
    OLD_CHAIN is the result of a "make" cleanup routine.
+   COUNTED is as for do_my_cleanups.
    Cleanups are discarded until we get back to the old end of the chain.  */
 
 static void
 discard_my_cleanups (struct cexcept_cleanup **pmy_chain,
-		     struct cexcept_cleanup *old_chain)
+		     struct cexcept_cleanup *old_chain, int counted)
 {
+  struct cexcept_cleanup *base = (*pmy_chain)->base;
   struct cexcept_cleanup *ptr;
 
   while ((ptr = *pmy_chain) != old_chain)
     {
       *pmy_chain = ptr->next;
+      if (counted)
+	note_cleanup_gone (ptr);
       if (ptr->free_arg)
 	(*ptr->free_arg) (ptr->arg);
-      free (ptr);
+      cexcept_xfree (ptr);
     }
+
+  uncover_cleanup (old_chain, base);
 }
 
 /* Discard cleanups, not doing the actions they describe,
@@ -217,7 +914,7 @@ discard_my_cleanups (struct cexcept_cleanup **pmy_chain,
 CEXCEPT_EXPORT void
 cexcept_discard_cleanups (struct cexcept_cleanup *old_chain)
 {
-  discard_my_cleanups (&cleanup_chain, old_chain);
+  discard_my_cleanups (&cleanup_chain, old_chain, 1);
 }
 
 /* Discard final cleanups, not doing the actions they describe,
@@ -226,7 +923,114 @@ cexcept_discard_cleanups (struct cexcept_cleanup *old_chain)
 CEXCEPT_EXPORT void
 cexcept_discard_final_cleanups (struct cexcept_cleanup *old_chain)
 {
-  discard_my_cleanups (&final_cleanup_chain, old_chain);
+  struct cexcept_cleanup *chain = detach_final_cleanups (old_chain);
+
+  discard_my_cleanups (&chain, old_chain, 0);
+}
+
+/* Discard cleanups and do the actions they describe until we get back
+   to the point OLD_CHAIN in *CHAIN, a chain of the caller's.  */
+
+CEXCEPT_EXPORT void
+cexcept_do_chain_cleanups (struct cexcept_cleanup **chain,
+			   struct cexcept_cleanup *old_chain)
+{
+  do_my_cleanups (chain, old_chain, 1);
+}
+
+/* Discard thread final cleanups, not doing the actions they describe,
+   until we get back to the point OLD_CHAIN in the calling thread's
+   thread_final_cleanup_chain.  */
+
+CEXCEPT_EXPORT void
+cexcept_discard_thread_final_cleanups (struct cexcept_cleanup *old_chain)
+{
+  discard_my_cleanups (&thread_final_cleanup_chain, old_chain, 1);
+}
+
+/* Discard cleanups, not doing the actions they describe, until we get
+   back to the point OLD_CHAIN in *CHAIN, a chain of the caller's.  */
+
+CEXCEPT_EXPORT void
+cexcept_discard_chain_cleanups (struct cexcept_cleanup **chain,
+				struct cexcept_cleanup *old_chain)
+{
+  discard_my_cleanups (chain, old_chain, 1);
+}
+
+/* Main worker routine to transfer cleanups.
+   PMY_CHAIN is a pointer to the chain the cleanups come from.
+   OLD_CHAIN is the result of a "make" cleanup routine.
+   PDEST is a pointer to the chain the cleanups go to.
+   The cleanups above OLD_CHAIN are unlinked from *PMY_CHAIN and pushed
+   on *PDEST, keeping their order.  Only the two ends of the run are
+   touched, so this takes constant time.  */
+
+static void
+transfer_my_cleanups (struct cexcept_cleanup **pmy_chain,
+		      struct cexcept_cleanup *old_chain,
+		      struct cexcept_cleanup **pdest)
+{
+  struct cexcept_cleanup *top = *pmy_chain;
+  struct cexcept_cleanup *base = top->base;
+  struct cexcept_cleanup *bottom;
+
+  if (top == old_chain)
+    return;
+
+  /* Find the oldest cleanup above OLD_CHAIN.  */
+  if (old_chain == SENTINEL_CLEANUP)
+    bottom = base;
+  else
+    bottom = old_chain->prev;
+  assert (bottom != NULL && bottom->next == old_chain);
+
+  *pmy_chain = old_chain;
+  uncover_cleanup (old_chain, base);
+
+  if (pdest == &final_cleanup_chain)
+    {
+      struct cexcept_cleanup *ptr;
+
+      /* The final cleanup chain is shared, and kept out of the
+	 per-thread counts; this is the only part that walks the
+	 run.  */
+      for (ptr = top; ptr != old_chain; ptr = ptr->next)
+	note_cleanup_gone (ptr);
+      push_final_cleanups (top, bottom);
+      return;
+    }
+
+  /* TOP is the newest cleanup of *PDEST from now on; only its BASE
+     needs to be right.  */
+  bottom->next = *pdest;
+  if (*pdest != SENTINEL_CLEANUP)
+    {
+      (*pdest)->prev = bottom;
+      top->base = (*pdest)->base;
+    }
+  else
+    top->base = bottom;
+  *pdest = top;
+}
+
+/* Move the cleanups made since OLD_CHAIN from the cleanup chain to
+   *DEST, without doing them.  */
+
+CEXCEPT_EXPORT void
+cexcept_transfer_cleanups (struct cexcept_cleanup *old_chain,
+			   struct cexcept_cleanup **dest)
+{
+  transfer_my_cleanups (&cleanup_chain, old_chain, dest);
+}
+
+/* Move the cleanups made since OLD_CHAIN from the cleanup chain to the
+   final cleanup chain, without doing them.  */
+
+CEXCEPT_EXPORT void
+cexcept_transfer_cleanups_to_final (struct cexcept_cleanup *old_chain)
+{
+  transfer_my_cleanups (&cleanup_chain, old_chain, &final_cleanup_chain);
 }
 
 /* Main worker routine to save cleanups.
@@ -256,7 +1060,8 @@ cexcept_save_cleanups (void)
 CEXCEPT_EXPORT struct cexcept_cleanup *
 cexcept_save_final_cleanups (void)
 {
-  return save_my_cleanups (&final_cleanup_chain);
+  return __atomic_exchange_n (&final_cleanup_chain, SENTINEL_CLEANUP,
+			      __ATOMIC_ACQ_REL);
 }
 
 /* Main worker routine to save cleanups.
@@ -283,7 +1088,7 @@ cexcept_restore_cleanups (struct cexcept_cleanup *chain)
 CEXCEPT_EXPORT void
 cexcept_restore_final_cleanups (struct cexcept_cleanup *chain)
 {
-  restore_my_cleanups (&final_cleanup_chain, chain);
+  __atomic_store_n (&final_cleanup_chain, chain, __ATOMIC_RELEASE);
 }
 
 /* Provide a known function that does nothing, to use as a base for
@@ -297,3 +1102,57 @@ CEXCEPT_EXPORT void
 cexcept_null_cleanup (void *arg)
 {
 }
+
+/* Store this thread's cleanup statistics in *STATS.  */
+
+CEXCEPT_EXPORT void
+cexcept_get_cleanup_stats (struct cexcept_cleanup_stats *stats)
+{
+  *stats = cleanup_stats;
+}
+
+/* Start this thread's peaks over from the current values.  */
+
+CEXCEPT_EXPORT void
+cexcept_reset_cleanup_peaks (void)
+{
+  cleanup_stats.peak_count = cleanup_stats.count;
+  cleanup_stats.peak_bytes = cleanup_stats.bytes;
+}
+
+#ifdef ENABLE_LEAK_CHECK
+
+/* The most leaked cleanups listed by cexcept_check_cleanup_leaks.  */
+#define LEAK_REPORT_MAX 16
+
+/* Report the cleanups still on the cleanup chain, which a TRY block
+   that exits normally would leak.  */
+
+void
+cexcept_check_cleanup_leaks (void)
+{
+  struct cexcept_cleanup *ptr;
+  int count = 0;
+
+  if (cleanup_chain == SENTINEL_CLEANUP)
+    return;
+
+  for (ptr = cleanup_chain; ptr != SENTINEL_CLEANUP; ptr = ptr->next)
+    count++;
+
+  fprintf (stderr,
+	   "libcexcept: %d cleanup%s left pending at the end of a TRY block,"
+	   " made at:\n", count, count == 1 ? "" : "s");
+  for (ptr = cleanup_chain, count = 0;
+       ptr != SENTINEL_CLEANUP && count < LEAK_REPORT_MAX;
+       ptr = ptr->next, count++)
+    {
+      fputs ("  ", stderr);
+      cexcept_print_address (stderr, ptr->site);
+      fputc ('\n', stderr);
+    }
+  if (ptr != SENTINEL_CLEANUP)
+    fputs ("  ...\n", stderr);
+}
+
+#endif /* ENABLE_LEAK_CHECK */
@@ -0,0 +1,168 @@
+/* Deferred cleanups for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* When a deferred cleanup is done, its work is pushed on a queue
+   instead of being run, and a reclaimer thread, started the first
+   time, runs it later.  Any thread may push; only the reclaimer pops.
+   The queue is a lock-free stack: pushing is a compare-and-swap on its
+   head, and the reclaimer takes the whole stack at once with an
+   exchange, then runs it oldest first.
+
+   The reclaimer sleeps on a semaphore, which is only posted by the
+   push that finds the stack empty, so a burst of deferred cleanups
+   costs a single wakeup.  */
+
+#include "config.h"
+
+#include "cleanups.h"
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "libcexcept-private.h"
+
+/* The newest work pushed and not yet taken by the reclaimer.  */
+static struct cexcept_deferred *deferred_head;
+
+/* Posted when DEFERRED_HEAD goes from empty to non-empty.  */
+static sem_t deferred_wakeup;
+
+/* Zero until the reclaimer is running; -1 if it could not be
+   started, in which case work is run right away.  */
+static int deferred_state;
+
+static pthread_once_t deferred_once = PTHREAD_ONCE_INIT;
+
+/* Counts of work pushed and run so far, for cexcept_drain_deferred.
+   DEFERRED_DONE is protected by DEFERRED_LOCK.  */
+static unsigned long deferred_pushed;
+static unsigned long deferred_done;
+static pthread_mutex_t deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deferred_cond = PTHREAD_COND_INITIALIZER;
+
+/* Run WORK and release the cleanup it is stored in.  */
+
+static void
+run_deferred (struct cexcept_deferred *work)
+{
+  (*work->function) (work->arg);
+  cexcept_xfree (work->storage);
+}
+
+static void
+note_deferred_done (unsigned long count)
+{
+  pthread_mutex_lock (&deferred_lock);
+  deferred_done += count;
+  pthread_cond_broadcast (&deferred_cond);
+  pthread_mutex_unlock (&deferred_lock);
+}
+
+static void *
+reclaimer_thread (void *arg)
+{
+  for (;;)
+    {
+      struct cexcept_deferred *work, *next, *oldest = NULL;
+      unsigned long count = 0;
+
+      while (sem_wait (&deferred_wakeup) != 0)
+	;
+
+      work = __atomic_exchange_n (&deferred_head, NULL, __ATOMIC_ACQUIRE);
+
+      /* Reverse the stack, to run the work in the order it was
+	 pushed.  */
+      for (; work != NULL; work = next)
+	{
+	  next = work->next;
+	  work->next = oldest;
+	  oldest = work;
+	}
+
+      for (work = oldest; work != NULL; work = next)
+	{
+	  next = work->next;
+	  run_deferred (work);
+	  count++;
+	}
+
+      if (count != 0)
+	note_deferred_done (count);
+    }
+
+  return NULL;
+}
+
+static void
+start_reclaimer (void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  if (sem_init (&deferred_wakeup, 0, 0) != 0)
+    {
+      deferred_state = -1;
+      return;
+    }
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &attr, reclaimer_thread, NULL) != 0)
+    deferred_state = -1;
+  else
+    deferred_state = 1;
+  pthread_attr_destroy (&attr);
+}
+
+/* Queue WORK for the reclaimer.  */
+
+void
+cexcept_defer (struct cexcept_deferred *work)
+{
+  struct cexcept_deferred *head;
+
+  pthread_once (&deferred_once, start_reclaimer);
+  if (deferred_state < 0)
+    {
+      run_deferred (work);
+      return;
+    }
+
+  __atomic_add_fetch (&deferred_pushed, 1, __ATOMIC_RELAXED);
+
+  head = __atomic_load_n (&deferred_head, __ATOMIC_RELAXED);
+  do
+    work->next = head;
+  while (!__atomic_compare_exchange_n (&deferred_head, &head, work, 1,
+				       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (head == NULL)
+    sem_post (&deferred_wakeup);
+}
+
+CEXCEPT_EXPORT void
+cexcept_drain_deferred (void)
+{
+  unsigned long target = __atomic_load_n (&deferred_pushed, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock (&deferred_lock);
+  while ((long) (deferred_done - target) < 0)
+    pthread_cond_wait (&deferred_cond, &deferred_lock);
+  pthread_mutex_unlock (&deferred_lock);
+}
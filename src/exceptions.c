@@ -21,6 +21,8 @@
 
 #include "exceptions.h"
 #include "cleanups.h"
+#include "catalog.h"
+#include "regions.h"
 
 #include <stdlib.h>
 #include <assert.h>
@@ -32,7 +34,7 @@
 #define internal_error(STR) \
   assert (0)
 
-const struct cexception exception_none = { 0, CEXCEPT_NO_ERROR, NULL };
+const struct cexception exception_none = { 0, CEXCEPT_NO_ERROR, NULL, NULL };
 
 /* Possible catcher states.  */
 enum catcher_state {
@@ -61,13 +63,34 @@ struct catcher
   volatile struct cexception *exception;
   /* Saved/current state.  */
   int mask;
+  const struct cexcept_filter *filter;
   struct cexcept_cleanup *saved_cleanup_chain;
+  /* The number of locks held when the catcher was pushed.  */
+  int saved_lock_count;
+  /* For a named region entered while recording, its name and when it
+     was entered; otherwise REGION_START is zero.  */
+  const char *region;
+  unsigned long long region_start;
+  /* Non-zero for the catcher of a CEXCEPT_TRY_FINALLY block.  */
+  int finally;
   /* Back link.  */
   struct catcher *prev;
 };
 
-/* Where to go for throw_exception().  */
-static struct catcher *current_catcher;
+/* Where to go for throw_exception().  Each thread has its own.  */
+static CEXCEPT_THREAD struct catcher *current_catcher;
+
+static void throw_exception (struct cexception exception)
+  ATTRIBUTE_NORETURN;
+
+/* Catchers popped by this thread, linked through PREV, kept for reuse
+   so that entering a TRY does not allocate.  */
+static CEXCEPT_THREAD struct catcher *catcher_cache;
+static CEXCEPT_THREAD int catcher_cache_size;
+static CEXCEPT_THREAD int catcher_cache_registered;
+
+/* The most catchers kept in catcher_cache.  */
+#define CATCHER_CACHE_MAX 16
 
 /* Return length of current_catcher list.  */
 
@@ -85,25 +108,44 @@ catcher_list_size (void)
   return size;
 }
 
-#define XZALLOC(TYPE) ((TYPE *) calloc (1, sizeof (TYPE)))
-
 CEXCEPT_EXPORT CEXCEPT_SIGJMP_BUF *
 cexcept_state_mc_init (volatile struct cexception *exception,
 		       return_mask mask)
 {
-  struct catcher *new_catcher = XZALLOC (struct catcher);
+  return cexcept_state_mc_init_filter (exception, mask, NULL);
+}
+
+CEXCEPT_EXPORT CEXCEPT_SIGJMP_BUF *
+cexcept_state_mc_init_filter (volatile struct cexception *exception,
+			      return_mask mask,
+			      const struct cexcept_filter *filter)
+{
+  struct catcher *new_catcher = catcher_cache;
+
+  if (new_catcher != NULL)
+    {
+      catcher_cache = new_catcher->prev;
+      catcher_cache_size--;
+    }
+  else
+    new_catcher = XNEW (struct catcher);
 
   /* Start with no exception, save it's address.  */
   exception->reason = 0;
   exception->error = CEXCEPT_NO_ERROR;
   exception->message = NULL;
+  exception->message_ref = NULL;
   new_catcher->exception = exception;
 
   new_catcher->mask = mask;
+  new_catcher->filter = filter;
+  new_catcher->region_start = 0;
+  new_catcher->finally = 0;
 
   /* Prevent error/quit during FUNC from calling cleanups established
      prior to here.  */
   new_catcher->saved_cleanup_chain = cexcept_save_cleanups ();
+  new_catcher->saved_lock_count = cexcept_lock_count;
 
   /* Push this new catcher on the top.  */
   new_catcher->prev = current_catcher;
@@ -113,19 +155,129 @@ cexcept_state_mc_init (volatile struct cexception *exception,
   return &new_catcher->buf;
 }
 
+CEXCEPT_EXPORT CEXCEPT_SIGJMP_BUF *
+cexcept_state_mc_init_named (volatile struct cexception *exception,
+			     return_mask mask, const char *region)
+{
+  CEXCEPT_SIGJMP_BUF *buf
+    = cexcept_state_mc_init_filter (exception, mask, NULL);
+
+  if (__builtin_expect (__atomic_load_n (&cexcept_region_recording,
+					 __ATOMIC_RELAXED), 0))
+    {
+      current_catcher->region = region;
+      current_catcher->region_start = cexcept_region_now ();
+    }
+  return buf;
+}
+
+CEXCEPT_EXPORT CEXCEPT_SIGJMP_BUF *
+cexcept_state_mc_init_finally (volatile struct cexception *exception)
+{
+  CEXCEPT_SIGJMP_BUF *buf
+    = cexcept_state_mc_init_filter (exception, RETURN_MASK_ALL, NULL);
+
+  current_catcher->finally = 1;
+  return buf;
+}
+
+/* Return the number of locks held when the current catcher was
+   pushed, or zero outside any TRY block.  */
+
+int
+cexcept_catcher_lock_count (void)
+{
+  return current_catcher != NULL ? current_catcher->saved_lock_count : 0;
+}
+
+/* Return non-zero if the calling thread is running a TRY block.  */
+
+int
+cexcept_catcher_active (void)
+{
+  return current_catcher != NULL;
+}
+
+/* Release the calling thread's catcher_cache, at thread exit.  */
+
+static void
+free_catcher_cache (void *arg)
+{
+  struct catcher *catcher;
+
+  while ((catcher = catcher_cache) != NULL)
+    {
+      catcher_cache = catcher->prev;
+      cexcept_xfree (catcher);
+    }
+  catcher_cache_size = 0;
+  catcher_cache_registered = 0;
+}
+
+/* Non-zero if the catcher popped last was that of a
+   CEXCEPT_TRY_FINALLY block, for cexcept_finally_begin to check.  */
+static CEXCEPT_THREAD int finally_popped;
+
+/* Pop the current catcher, left the way HOW says, a value of enum
+   cexcept_region_exit.  */
+
 static void
-catcher_pop (void)
+catcher_pop (int how)
 {
   struct catcher *old_catcher = current_catcher;
 
   current_catcher = old_catcher->prev;
 
+  if (__builtin_expect (old_catcher->region_start != 0, 0))
+    cexcept_region_record (old_catcher->region, how,
+			   old_catcher->region_start);
+  finally_popped = old_catcher->finally;
+
   /* Restore the cleanup chain, the error/quit messages, and the uiout
      builder, to their original states.  */
 
   cexcept_restore_cleanups (old_catcher->saved_cleanup_chain);
 
-  free (old_catcher);
+  if (catcher_cache_size < CATCHER_CACHE_MAX)
+    {
+      if (!catcher_cache_registered)
+	{
+	  catcher_cache_registered = 1;
+	  cexcept_make_thread_final_cleanup (free_catcher_cache, NULL);
+	}
+      old_catcher->prev = catcher_cache;
+      catcher_cache = old_catcher;
+      catcher_cache_size++;
+    }
+  else
+    cexcept_xfree (old_catcher);
+}
+
+/* Return non-zero if EXCEPTION passes FILTER.  */
+
+static int
+filter_accepts (const struct cexcept_filter *filter,
+		const struct cexception *exception)
+{
+  if (exception->error >= 0 && exception->error < 64
+      && (filter->codes & CEXCEPT_ERROR_BIT (exception->error)) != 0)
+    return 1;
+  return (filter->predicate != NULL
+	  && (*filter->predicate) (exception, filter->data));
+}
+
+/* Return non-zero if CATCHER handles EXCEPTION.  */
+
+static int
+catcher_accepts (const struct catcher *catcher,
+		 const struct cexception *exception)
+{
+  /* The block after a finally catcher must see every exception.  */
+  if (catcher->finally)
+    return 1;
+  return ((catcher->mask & RETURN_MASK (exception->reason)) != 0
+	  && (catcher->filter == NULL
+	      || filter_accepts (catcher->filter, exception)));
 }
 
 /* Catcher state machine.  Returns non-zero if the m/c should be run
@@ -151,7 +303,8 @@ cexcept_state_mc (enum catcher_action action)
 	{
 	case CATCH_ITER:
 	  /* No error/quit has occured.  Just clean up.  */
-	  catcher_pop ();
+	  cexcept_check_cleanup_leaks ();
+	  catcher_pop (CEXCEPT_REGION_NORMAL);
 	  return 0;
 	case CATCH_ITER_1:
 	  current_catcher->state = CATCHER_RUNNING_1;
@@ -168,7 +321,8 @@ cexcept_state_mc (enum catcher_action action)
 	{
 	case CATCH_ITER:
 	  /* The did a "break" from the inner while loop.  */
-	  catcher_pop ();
+	  cexcept_check_cleanup_leaks ();
+	  catcher_pop (CEXCEPT_REGION_NORMAL);
 	  return 0;
 	case CATCH_ITER_1:
 	  current_catcher->state = CATCHER_RUNNING;
@@ -187,19 +341,22 @@ cexcept_state_mc (enum catcher_action action)
 	  {
 	    struct cexception exception = *current_catcher->exception;
 
-	    if (current_catcher->mask & RETURN_MASK (exception.reason))
+	    if (catcher_accepts (current_catcher, &exception))
 	      {
 		/* Exit normally if this catcher can handle this
 		   exception.  The caller analyses the func return
 		   values.  */
-		catcher_pop ();
+		cexcept_profile_landed (1);
+		catcher_pop (CEXCEPT_REGION_EXCEPTION);
 		return 0;
 	      }
 	    /* The caller didn't request that the event be caught,
 	       relay the event to the next containing
-	       catch_errors().  */
-	    catcher_pop ();
-	    cexcept_throw (exception);
+	       catch_errors().  throw_exception only jumps here for the
+	       outermost catcher.  */
+	    cexcept_profile_landed (0);
+	    catcher_pop (CEXCEPT_REGION_EXCEPTION);
+	    throw_exception (exception);
 	  }
 	default:
 	  internal_error ("bad state");
@@ -223,19 +380,58 @@ cexcept_state_mc_action_iter_1 (void)
 
 /* Return EXCEPTION to the nearest containing TRY_CATCH.  */
 
-CEXCEPT_EXPORT void
-cexcept_throw (struct cexception exception)
+/* Do the cleanups made since the current catcher was pushed, then
+   unlock the locks taken since.  */
+
+static void
+unwind_segment (void)
 {
   cexcept_do_cleanups (cexcept_all_cleanups ());
+  if (cexcept_lock_count > current_catcher->saved_lock_count)
+    cexcept_release_locks (current_catcher->saved_lock_count);
+}
+
+static void
+throw_exception (struct cexception exception)
+{
+  unwind_segment ();
+
+  /* A catcher that does not handle the exception would only relay it
+     to the next one, so pop it here, running the cleanups it
+     protected, instead of jumping to it.  This way a throw takes a
+     single long jump however many catchers it crosses, and cleanups
+     still run innermost first.  The outermost catcher is always jumped
+     to, and relays the exception itself if need be.  */
+  while (current_catcher->prev != NULL
+	 && !catcher_accepts (current_catcher, &exception))
+    {
+      catcher_pop (CEXCEPT_REGION_EXCEPTION);
+      unwind_segment ();
+    }
 
   /* Jump to the containing catch_errors() call, communicating REASON
      to that call via setjmp's return value.  Note that REASON can't
      be zero, by definition in defs.h.  */
   cexcept_state_mc (CATCH_THROWING);
   *current_catcher->exception = exception;
+  cexcept_profile_jump ();
   CEXCEPT_SIGLONGJMP (current_catcher->buf, exception.reason);
 }
 
+CEXCEPT_EXPORT void
+cexcept_throw (struct cexception exception)
+{
+  const void *site = __builtin_return_address (0);
+
+  /* The caller owns the message.  */
+  exception.message_ref = NULL;
+
+  cexcept_profile_throw_begin (site);
+  if (cexcept_recorder != NULL)
+    cexcept_recorder_record (&exception, site, catcher_list_size ());
+  throw_exception (exception);
+}
+
 /* A stack of exception messages.
    This is needed to handle nested calls to throw_it: we don't want to
    free space for a message before it's used.
@@ -245,59 +441,150 @@ cexcept_throw (struct cexception exception)
 
    This is indexed by the size of the current_catcher list.
    It is a dynamically allocated array so that we don't care how deeply
-   GDB nests its TRY_CATCHs.  */
-static char **exception_messages;
+   GDB nests its TRY_CATCHs.  Each thread has its own, released when
+   the thread exits.  */
+static CEXCEPT_THREAD struct cexcept_message **exception_messages;
 
 /* The number of currently allocated entries in exception_messages.  */
-static int exception_messages_size;
+static CEXCEPT_THREAD int exception_messages_size;
 
-static void ATTRIBUTE_NORETURN ATTRIBUTE_PRINTF (3, 0)
-throw_it (enum cexcept_return_reason reason, int error, const char *fmt,
-	  va_list ap)
+static struct cexcept_message *
+message_retain (struct cexcept_message *message)
 {
-  struct cexception e;
-  char *new_message;
-  int depth = catcher_list_size ();
+  if (message != NULL)
+    __atomic_add_fetch (&message->refcount, 1, __ATOMIC_RELAXED);
+  return message;
+}
 
-  assert (depth > 0);
+static void
+message_release (struct cexcept_message *message)
+{
+  if (message != NULL
+      && __atomic_sub_fetch (&message->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      if (message->catalog)
+	{
+	  if (message->text != NULL)
+	    cexcept_xfree (message->text);
+	  if (message->strings != NULL)
+	    cexcept_xfree (message->strings);
+	}
+      cexcept_xfree (message);
+    }
+}
 
-  /* Note: The new message may use an old message's text.  */
-  vasprintf (&new_message, fmt, ap);
+/* Return a new message, with one reference, formatted from FMT and
+   AP.  */
+
+static struct cexcept_message * ATTRIBUTE_PRINTF (1, 0)
+message_format (const char *fmt, va_list ap)
+{
+  struct cexcept_message *message;
+  va_list aq;
+  int len;
+
+  va_copy (aq, ap);
+  len = vsnprintf (NULL, 0, fmt, aq);
+  va_end (aq);
+
+  if (len < 0)
+    len = 0;
+  message = cexcept_xmalloc (offsetof (struct cexcept_message, storage)
+			     + len + 1);
+  message->refcount = 1;
+  message->catalog = 0;
+  message->text = message->storage;
+  vsnprintf (message->text, len + 1, fmt, ap);
+  return message;
+}
+
+/* Release the calling thread's exception_messages, at thread exit.  */
+
+static void
+free_exception_messages (void *arg)
+{
+  int i;
+
+  for (i = 0; i < exception_messages_size; i++)
+    message_release (exception_messages[i]);
+  cexcept_xfree (exception_messages);
+  exception_messages = NULL;
+  exception_messages_size = 0;
+}
+
+/* Make MESSAGE, whose reference the caller hands over, the message of
+   the exception being thrown from DEPTH, dropping the one thrown from
+   there before.  */
 
+static void
+set_depth_message (int depth, struct cexcept_message *message)
+{
   if (depth > exception_messages_size)
     {
       int old_size = exception_messages_size;
 
+      if (old_size == 0)
+	cexcept_make_thread_final_cleanup (free_exception_messages, NULL);
       exception_messages_size = depth + 10;
-      exception_messages = (char **) realloc (exception_messages,
-					      exception_messages_size
-					      * sizeof (char *));
+      exception_messages = (struct cexcept_message **)
+	cexcept_xrealloc (exception_messages,
+			  exception_messages_size
+			  * sizeof (struct cexcept_message *));
       memset (exception_messages + old_size, 0,
-	      (exception_messages_size - old_size) * sizeof (char *));
+	      (exception_messages_size - old_size)
+	      * sizeof (struct cexcept_message *));
     }
 
-  free (exception_messages[depth - 1]);
-  exception_messages[depth - 1] = new_message;
+  message_release (exception_messages[depth - 1]);
+  exception_messages[depth - 1] = message;
+}
+
+/* Throw an exception with a message formatted from FMT and AP.  SITE
+   is the address the throw is attributed to.  */
+
+static void ATTRIBUTE_NORETURN ATTRIBUTE_PRINTF (4, 0)
+throw_it (enum cexcept_return_reason reason, int error, const void *site,
+	  const char *fmt, va_list ap)
+{
+  struct cexception e;
+  struct cexcept_message *new_message;
+  int depth = catcher_list_size ();
+
+  assert (depth > 0);
+
+  cexcept_profile_throw_begin (site);
+
+  /* Note: The new message may use an old message's text.  */
+  cexcept_profile_format_begin ();
+  new_message = message_format (fmt, ap);
+  cexcept_profile_format_end ();
+
+  set_depth_message (depth, new_message);
 
   /* Create the exception.  */
   e.reason = reason;
   e.error = error;
-  e.message = new_message;
+  e.message = new_message->text;
+  e.message_ref = new_message;
+
+  if (cexcept_recorder != NULL)
+    cexcept_recorder_record (&e, site, depth);
 
   /* Throw the exception.  */
-  cexcept_throw (e);
+  throw_exception (e);
 }
 
 CEXCEPT_EXPORT void
 cexcept_throw_verror (int error, const char *fmt, va_list ap)
 {
-  throw_it (RETURN_ERROR, error, fmt, ap);
+  throw_it (RETURN_ERROR, error, __builtin_return_address (0), fmt, ap);
 }
 
 CEXCEPT_EXPORT void
 cexcept_throw_vfatal (const char *fmt, va_list ap)
 {
-  throw_it (RETURN_QUIT, CEXCEPT_NO_ERROR, fmt, ap);
+  throw_it (RETURN_QUIT, CEXCEPT_NO_ERROR, __builtin_return_address (0),
+	    fmt, ap);
 }
 
 CEXCEPT_EXPORT void
@@ -306,6 +593,196 @@ cexcept_throw_error (int error, const char *fmt, ...)
   va_list args;
 
   va_start (args, fmt);
-  throw_it (RETURN_ERROR, error, fmt, args);
+  throw_it (RETURN_ERROR, error, __builtin_return_address (0), fmt, args);
   va_end (args);
 }
+
+/* Return the message to capture a catalog message thrown from DEPTH
+   into.  This is the message thrown from there before if it is a
+   catalog message that nobody retained, so that throwing again does
+   not allocate; otherwise it is a new one.  The text of a reused
+   message is left in place, as the new arguments may point into it;
+   the caller frees it once they are captured.  */
+
+static struct cexcept_message *
+catalog_message (int depth)
+{
+  struct cexcept_message *message;
+
+  if (depth <= exception_messages_size)
+    {
+      message = exception_messages[depth - 1];
+      if (message != NULL && message->catalog
+	  && __atomic_load_n (&message->refcount, __ATOMIC_ACQUIRE) == 1)
+	return message;
+    }
+
+  message = XZALLOC (struct cexcept_message);
+  message->refcount = 1;
+  message->catalog = 1;
+  set_depth_message (depth, message);
+  return message;
+}
+
+/* Throw an exception with message ID of the catalog, capturing its
+   arguments from AP.  SITE is the address the throw is attributed
+   to.  */
+
+static void ATTRIBUTE_NORETURN
+throw_msg (enum cexcept_return_reason reason, int error, const void *site,
+	   unsigned int id, va_list ap)
+{
+  struct cexception e;
+  struct cexcept_message *message;
+  char *old_text;
+  int depth = catcher_list_size ();
+
+  assert (depth > 0);
+
+  cexcept_profile_throw_begin (site);
+
+  /* Note: The new message may use an old message's text.  */
+  cexcept_profile_format_begin ();
+  message = catalog_message (depth);
+  old_text = message->text;
+  message->text = NULL;
+  message->id = id;
+  message->format = cexcept_catalog_format (id);
+  if (message->format != NULL)
+    cexcept_message_capture (message, ap);
+  if (old_text != NULL)
+    cexcept_xfree (old_text);
+  cexcept_profile_format_end ();
+
+  e.reason = reason;
+  e.error = error;
+  e.message = NULL;
+  e.message_ref = message;
+
+  if (cexcept_recorder != NULL)
+    {
+      /* The text is not rendered yet; record the format instead.  */
+      struct cexception recorded = e;
+
+      recorded.message = message->format;
+      cexcept_recorder_record (&recorded, site, depth);
+    }
+
+  throw_exception (e);
+}
+
+CEXCEPT_EXPORT void
+cexcept_throw_vmsg (int error, unsigned int id, va_list ap)
+{
+  throw_msg (RETURN_ERROR, error, __builtin_return_address (0), id, ap);
+}
+
+CEXCEPT_EXPORT void
+cexcept_throw_msg (int error, unsigned int id, ...)
+{
+  va_list args;
+
+  va_start (args, id);
+  throw_msg (RETURN_ERROR, error, __builtin_return_address (0), id, args);
+  va_end (args);
+}
+
+CEXCEPT_EXPORT const char *
+cexcept_exception_message (const volatile struct cexception *exception)
+{
+  struct cexcept_message *message = exception->message_ref;
+  char *text, *expected = NULL;
+
+  if (message == NULL || !message->catalog)
+    return exception->message;
+
+  text = __atomic_load_n (&message->text, __ATOMIC_ACQUIRE);
+  if (text != NULL)
+    return text;
+
+  /* A retained exception may be rendered by several threads at once;
+     the first to finish wins.  */
+  text = cexcept_message_render (message);
+  if (!__atomic_compare_exchange_n (&message->text, &expected, text, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      cexcept_xfree (text);
+      text = expected;
+    }
+  return text;
+}
+
+CEXCEPT_EXPORT void
+cexcept_exception_retain (const struct cexception *exception)
+{
+  message_retain (exception->message_ref);
+}
+
+CEXCEPT_EXPORT void
+cexcept_exception_release (const struct cexception *exception)
+{
+  message_release (exception->message_ref);
+}
+
+/* Throw EXCEPTION again.  SITE is the address the throw is attributed
+   to.  */
+
+static void ATTRIBUTE_NORETURN
+rethrow_it (struct cexception exception, const void *site)
+{
+  int depth = catcher_list_size ();
+
+  assert (depth > 0);
+
+  cexcept_profile_throw_begin (site);
+
+  /* Keep the message alive as if it had been thrown from here.  */
+  if (exception.message_ref != NULL)
+    set_depth_message (depth, message_retain (exception.message_ref));
+
+  if (cexcept_recorder != NULL)
+    cexcept_recorder_record (&exception, site, depth);
+  throw_exception (exception);
+}
+
+CEXCEPT_EXPORT void
+cexcept_rethrow (struct cexception exception)
+{
+  rethrow_it (exception, __builtin_return_address (0));
+}
+
+CEXCEPT_EXPORT int
+cexcept_finally_begin (const volatile struct cexception *exception)
+{
+  int depth = catcher_list_size ();
+
+  /* After a TRY block that does not catch everything, the finally block
+     would be skipped by some exceptions, without a word.  */
+  if (!finally_popped)
+    {
+      fputs ("libcexcept: CEXCEPT_FINALLY must follow a CEXCEPT_TRY_FINALLY"
+	     " block\n", stderr);
+      abort ();
+    }
+  finally_popped = 0;
+
+  /* The message lives in the slot of the depth it was thrown from,
+     which the finally block may reuse by throwing and catching
+     exceptions of its own.  Keep it in the slot of this depth too, as
+     the rethrow at the end of the block would.  */
+  if (exception->reason < 0 && exception->message_ref != NULL && depth > 0)
+    set_depth_message (depth, message_retain (exception->message_ref));
+  return 1;
+}
+
+CEXCEPT_EXPORT int
+cexcept_finally_end (const volatile struct cexception *exception)
+{
+  if (exception->reason < 0)
+    {
+      struct cexception e = *exception;
+
+      rethrow_it (e, __builtin_return_address (0));
+    }
+  return 0;
+}
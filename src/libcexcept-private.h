@@ -20,6 +20,180 @@
 
 #include <cexcept/libcexcept.h>
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#ifndef CEXCEPT_EXPORT
 #define CEXCEPT_EXPORT __attribute__ ((visibility("default")))
+#endif
+
+/* Thread-local library state used on every TRY and cleanup.  The
+   initial-exec model makes each access a single load from the thread
+   pointer, instead of a call to __tls_get_addr from the shared
+   library.  */
+#define CEXCEPT_THREAD __thread __attribute__ ((tls_model ("initial-exec")))
+
+/* Internal allocation entry points, going through the hooks
+   installed with cexcept_set_allocator.  These never return NULL.  */
+extern void *cexcept_xmalloc (size_t size) ATTRIBUTE_MALLOC;
+extern void *cexcept_xzalloc (size_t size) ATTRIBUTE_MALLOC;
+extern void *cexcept_xrealloc (void *ptr, size_t size);
+extern void cexcept_xfree (void *ptr);
+
+/* Unwind cost profiling hooks, see profile.c.  */
+#ifdef ENABLE_PROFILING
+extern unsigned long long cexcept_profile_now (void);
+extern void cexcept_profile_throw_begin (const void *site);
+extern void cexcept_profile_format_begin (void);
+extern void cexcept_profile_format_end (void);
+extern void cexcept_profile_jump (void);
+extern void cexcept_profile_landed (int handled);
+extern void cexcept_profile_call_cleanup (void (*function) (void *),
+					  void *arg);
+#else
+#define cexcept_profile_throw_begin(SITE) do { } while (0)
+#define cexcept_profile_format_begin() do { } while (0)
+#define cexcept_profile_format_end() do { } while (0)
+#define cexcept_profile_jump() do { } while (0)
+#define cexcept_profile_landed(HANDLED) do { } while (0)
+#define cexcept_profile_call_cleanup(FUNCTION, ARG) (*(FUNCTION)) (ARG)
+#endif
+
+/* Print a symbolic name for ADDR to STREAM, see profile.c.  */
+#if defined ENABLE_PROFILING || defined ENABLE_LEAK_CHECK
+extern void cexcept_print_address (FILE *stream, const void *addr);
+#endif
+
+/* Report the cleanups a TRY block is about to leak, see cleanups.c.  */
+#ifdef ENABLE_LEAK_CHECK
+extern void cexcept_check_cleanup_leaks (void);
+#else
+#define cexcept_check_cleanup_leaks() do { } while (0)
+#endif
+
+/* The argument of the calling thread's newest cleanup, see
+   cleanups.c.  */
+extern void *cexcept_newest_cleanup_arg (void);
+
+/* The exception flight recorder, see recorder.c.  The recorder is
+   active when cexcept_recorder is non-NULL.  */
+struct recorder_header;
+extern struct recorder_header *cexcept_recorder;
+extern void cexcept_recorder_record (const struct cexception *exception,
+				     const void *site, int depth);
+
+/* Named TRY regions, see regions.c.  The catchers of named regions
+   entered while cexcept_region_recording is non-zero are timed.  */
+extern int cexcept_region_recording;
+extern unsigned long long cexcept_region_now (void);
+extern void cexcept_region_record (const char *region, int how,
+				   unsigned long long start);
+
+/* The number of entries in the calling thread's array of locks taken
+   with cexcept_lock, and the unlocking of those taken since it had
+   COUNT, see locks.c.  */
+extern CEXCEPT_THREAD int cexcept_lock_count;
+extern void cexcept_release_locks (int count);
+
+/* Non-zero if the calling thread is running a TRY block, see
+   exceptions.c.  */
+extern int cexcept_catcher_active (void);
+
+/* The number of entries in that array when the current catcher was
+   pushed, see exceptions.c.  */
+extern int cexcept_catcher_lock_count (void);
+
+/* Log through the library context, see libcexcept.c.  */
+struct cexcept_ctx;
+extern void cexcept_log (struct cexcept_ctx *ctx, int priority,
+			 const char *file, int line, const char *fn,
+			 const char *format, ...)
+  ATTRIBUTE_PRINTF (6, 7);
+
+/* The most arguments captured for a catalog message, counting those
+   of '*' widths and precisions.  */
+#define CEXCEPT_MESSAGE_MAX_ARGS 8
+
+/* An argument of a catalog message.  A %s argument is copied, and
+   referred to by its OFFSET in the message's strings.  */
+union cexcept_message_arg
+{
+  int i;
+  long l;
+  long long ll;
+  intmax_t j;
+  size_t z;
+  ptrdiff_t t;
+  double d;
+  long double ld;
+  const void *p;
+  size_t offset;
+};
+
+/* The storage of an exception message, see exceptions.c.  It is
+   referenced by the exception_messages slot it was thrown from, and by
+   any retained copies of the exception.  */
+struct cexcept_message
+{
+  int refcount;
+  /* Non-zero for a message thrown by id from the message catalog.  */
+  int catalog;
+  /* The text.  For a catalog message, NULL until it is first asked
+     for, then rendered into memory of its own.  */
+  char *text;
+  /* For a catalog message, its id and its format, NULL if the id was
+     not in the catalog; the number of the format's conversions that
+     were captured, their arguments, and the copies of their strings.
+     These are kept across throws from the same depth, so that the
+     next one need not allocate.  */
+  unsigned int id;
+  const char *format;
+  int nconversions;
+  union cexcept_message_arg args[CEXCEPT_MESSAGE_MAX_ARGS];
+  char *strings;
+  size_t strings_used;
+  size_t strings_size;
+  /* The text of a message formatted when thrown.  */
+  char storage[];
+};
+
+/* The message catalog, see catalog.c.  */
+extern const char *cexcept_catalog_format (unsigned int id);
+extern void cexcept_message_capture (struct cexcept_message *message,
+				     va_list ap);
+extern char *cexcept_message_render (const struct cexcept_message *message)
+  ATTRIBUTE_MALLOC;
+
+/* The work of a deferred cleanup, stored in the cleanup itself, see
+   deferred.c.  STORAGE is the cleanup, freed once the work is run.  */
+struct cexcept_deferred
+{
+  struct cexcept_deferred *next;
+  void (*function) (void *);
+  void *arg;
+  void *storage;
+};
+extern void cexcept_defer (struct cexcept_deferred *work);
+
+/* A run of undo records, the argument of an undo cleanup, see undo.c.
+   CHUNK and USED are where the records' arena was when the run
+   started.  */
+struct cexcept_undo_record;
+struct cexcept_undo
+{
+  struct cexcept_undo_record *last;
+  void *chunk;
+  size_t used;
+};
+extern void cexcept_undo_open (struct cexcept_undo *journal);
+extern void cexcept_undo_record (struct cexcept_undo *journal, void *ptr,
+				 size_t size);
+extern void cexcept_undo_restore (void *journal);
+extern void cexcept_undo_release (void *journal);
+
+#define XNEW(TYPE) ((TYPE *) cexcept_xmalloc (sizeof (TYPE)))
+#define XZALLOC(TYPE) ((TYPE *) cexcept_xzalloc (sizeof (TYPE)))
 
 #endif
@@ -23,10 +23,34 @@
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
+#include <syslog.h>
 
 #include <cexcept/libcexcept.h>
 #include "libcexcept-private.h"
 
+static inline void __attribute__((always_inline, format(printf, 2, 3)))
+cexcept_log_null(struct cexcept_ctx *ctx, const char *format, ...) {}
+
+#define cexcept_log_cond(ctx, prio, arg...) \
+        do { \
+                if (cexcept_get_log_priority(ctx) >= prio) \
+                        cexcept_log(ctx, prio, __FILE__, __LINE__, __FUNCTION__, ## arg); \
+        } while (0)
+
+#ifdef ENABLE_LOGGING
+#  ifdef ENABLE_DEBUG
+#    define dbg(ctx, arg...) cexcept_log_cond(ctx, LOG_DEBUG, ## arg)
+#  else
+#    define dbg(ctx, arg...) cexcept_log_null(ctx, ## arg)
+#  endif
+#  define info(ctx, arg...) cexcept_log_cond(ctx, LOG_INFO, ## arg)
+#  define err(ctx, arg...) cexcept_log_cond(ctx, LOG_ERR, ## arg)
+#else
+#  define dbg(ctx, arg...) cexcept_log_null(ctx, ## arg)
+#  define info(ctx, arg...) cexcept_log_null(ctx, ## arg)
+#  define err(ctx, arg...) cexcept_log_null(ctx, ## arg)
+#endif
+
 /**
  * SECTION:libcexcept
  * @short_description: libcexcept context
@@ -162,7 +186,7 @@ CEXCEPT_EXPORT struct cexcept_ctx *cexcept_ref(struct cexcept_ctx *ctx)
 {
         if (ctx == NULL)
                 return NULL;
-        ctx->refcount++;
+        __atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_RELAXED);
         return ctx;
 }
 
@@ -178,8 +202,9 @@ CEXCEPT_EXPORT struct cexcept_ctx *cexcept_unref(struct cexcept_ctx *ctx)
 {
         if (ctx == NULL)
                 return NULL;
-        ctx->refcount--;
-        if (ctx->refcount > 0)
+        /* Release our uses of the context, and on the last reference,
+         * acquire everyone else's before freeing it. */
+        if (__atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_ACQ_REL) > 0)
                 return ctx;
         info(ctx, "context %p released\n", ctx);
         free(ctx);
@@ -229,57 +254,3 @@ CEXCEPT_EXPORT void cexcept_set_log_priority(struct cexcept_ctx *ctx, int priori
 {
         ctx->log_priority = priority;
 }
-
-struct cexcept_list_entry;
-struct cexcept_list_entry *cexcept_list_entry_get_next(struct cexcept_list_entry *list_entry);
-const char *cexcept_list_entry_get_name(struct cexcept_list_entry *list_entry);
-const char *cexcept_list_entry_get_value(struct cexcept_list_entry *list_entry);
-
-struct cexcept_thing {
-        struct cexcept_ctx *ctx;
-        int refcount;
-};
-
-CEXCEPT_EXPORT struct cexcept_thing *cexcept_thing_ref(struct cexcept_thing *thing)
-{
-        if (!thing)
-                return NULL;
-        thing->refcount++;
-        return thing;
-}
-
-CEXCEPT_EXPORT struct cexcept_thing *cexcept_thing_unref(struct cexcept_thing *thing)
-{
-        if (thing == NULL)
-                return NULL;
-        thing->refcount--;
-        if (thing->refcount > 0)
-                return thing;
-        dbg(thing->ctx, "context %p released\n", thing);
-        free(thing);
-        return NULL;
-}
-
-CEXCEPT_EXPORT struct cexcept_ctx *cexcept_thing_get_ctx(struct cexcept_thing *thing)
-{
-        return thing->ctx;
-}
-
-CEXCEPT_EXPORT int cexcept_thing_new_from_string(struct cexcept_ctx *ctx, const char *string, struct cexcept_thing **thing)
-{
-        struct cexcept_thing *t;
-
-        t = calloc(1, sizeof(struct cexcept_thing));
-        if (!t)
-                return -ENOMEM;
-
-        t->refcount = 1;
-        t->ctx = ctx;
-        *thing = t;
-        return 0;
-}
-
-CEXCEPT_EXPORT struct cexcept_list_entry *cexcept_thing_get_some_list_entry(struct cexcept_thing *thing)
-{
-        return NULL;
-}
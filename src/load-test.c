@@ -0,0 +1,331 @@
+/* Load test for GNU cexcept: a simulated request server.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Usage: load-test [-t THREADS] [-n REQUESTS] [-d DEPTH] [-c CLEANUPS]
+		    [-f FAILURE-RATE] [-s SEED]
+
+   Each of THREADS worker threads handles REQUESTS synthetic requests.
+   A request descends DEPTH levels, each in its own TRY block, and
+   makes CLEANUPS cleanups at each level, of the kinds real code makes:
+   freeing memory, with inline arguments, and a growable buffer.  At the
+   bottom, the request fails with probability FAILURE-RATE, throwing an
+   error that unwinds all the levels to the outermost catcher.
+
+   The report gives the throughput, the latency percentiles of
+   requests that succeeded and of those that failed, and the peak
+   resident set size.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <cexcept/libcexcept.h>
+
+#define LOAD_ERROR 1
+
+/* The parameters of the run.  */
+static int nthreads = 4;
+static long nrequests = 100000;
+static int depth = 8;
+static int ncleanups = 2;
+static double failure_rate = 0.01;
+static unsigned int seed = 1;
+
+/* What a worker measured.  */
+
+struct worker
+{
+  pthread_t thread;
+  unsigned int rand_state;
+  /* Latencies of the successful and failed requests, in
+     nanoseconds.  */
+  unsigned long long *ok_ns;
+  long nok;
+  unsigned long long *error_ns;
+  long nerror;
+};
+
+static unsigned long long
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A pseudo-random number in [0, 1), from STATE.  */
+
+static double
+next_random (unsigned int *state)
+{
+  /* xorshift32.  */
+  unsigned int x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x / 4294967296.0;
+}
+
+/* The argument of an inline cleanup.  */
+
+struct request_state
+{
+  int level;
+  int *checksum;
+};
+
+static void
+undo_request_state (void *arg)
+{
+  struct request_state *state = arg;
+
+  *state->checksum -= state->level;
+}
+
+/* Handle LEVEL of a request for WORKER.  */
+
+static void
+handle_level (struct worker *worker, int level, int *checksum)
+{
+  volatile struct cexception e;
+  char small[32];
+  struct cexcept_buf reply;
+  int i;
+
+  if (level == depth)
+    {
+      if (next_random (&worker->rand_state) < failure_rate)
+	cexcept_throw_error (LOAD_ERROR, "request failed at depth %d",
+			     level);
+      return;
+    }
+
+  CEXCEPT_TRY (e, RETURN_MASK_QUIT)
+    {
+      for (i = 0; i < ncleanups; i++)
+	if (i == 2)
+	  {
+	    cexcept_buf_init (&reply, small, sizeof (small));
+	    cexcept_buf_append (&reply, "request", 7);
+	  }
+	else if (i % 2 == 1)
+	  {
+	    struct request_state state;
+
+	    state.level = level;
+	    state.checksum = checksum;
+	    *checksum += level;
+	    cexcept_make_cleanup_inline (undo_request_state, &state,
+					 sizeof (state));
+	  }
+	else
+	  cexcept_make_cleanup_free (malloc (64));
+
+      handle_level (worker, level + 1, checksum);
+
+      cexcept_do_cleanups (cexcept_all_cleanups ());
+    }
+}
+
+static void *
+worker_main (void *arg)
+{
+  struct worker *worker = arg;
+  long i;
+
+  for (i = 0; i < nrequests; i++)
+    {
+      volatile struct cexception e;
+      unsigned long long start = now_ns ();
+      int checksum = 0;
+
+      CEXCEPT_TRY (e, RETURN_MASK_ERROR)
+	{
+	  handle_level (worker, 0, &checksum);
+	}
+
+      if (checksum != 0)
+	{
+	  fprintf (stderr, "load-test: cleanups went missing\n");
+	  abort ();
+	}
+
+      if (e.reason < 0)
+	worker->error_ns[worker->nerror++] = now_ns () - start;
+      else
+	worker->ok_ns[worker->nok++] = now_ns () - start;
+    }
+
+  return NULL;
+}
+
+static int
+compare_ns (const void *a, const void *b)
+{
+  unsigned long long na = *(const unsigned long long *) a;
+  unsigned long long nb = *(const unsigned long long *) b;
+
+  return (na > nb) - (na < nb);
+}
+
+/* Print the latency percentiles of the N samples in NS, which are
+   sorted in place.  */
+
+static void
+report_latencies (const char *what, unsigned long long *ns, long n)
+{
+  static const double percentiles[] = { 50, 99, 99.9 };
+  int i;
+
+  printf ("%-8s %10ld requests", what, n);
+  if (n == 0)
+    {
+      putchar ('\n');
+      return;
+    }
+
+  qsort (ns, n, sizeof (*ns), compare_ns);
+  for (i = 0; i < (int) (sizeof (percentiles) / sizeof (percentiles[0])); i++)
+    {
+      long index = (long) (percentiles[i] / 100 * n);
+
+      if (index >= n)
+	index = n - 1;
+      printf ("  p%g %8.2f us", percentiles[i], ns[index] / 1000.0);
+    }
+  putchar ('\n');
+}
+
+static void
+usage (const char *program)
+{
+  fprintf (stderr,
+	   "usage: %s [-t THREADS] [-n REQUESTS] [-d DEPTH] [-c CLEANUPS]\n"
+	   "          [-f FAILURE-RATE] [-s SEED]\n", program);
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct worker *workers;
+  unsigned long long start, elapsed, *ok_ns, *error_ns;
+  long nok = 0, nerror = 0;
+  struct rusage usage_self;
+  int opt, i;
+
+  while ((opt = getopt (argc, argv, "t:n:d:c:f:s:")) != -1)
+    switch (opt)
+      {
+      case 't':
+	nthreads = atoi (optarg);
+	break;
+      case 'n':
+	nrequests = atol (optarg);
+	break;
+      case 'd':
+	depth = atoi (optarg);
+	break;
+      case 'c':
+	ncleanups = atoi (optarg);
+	break;
+      case 'f':
+	failure_rate = atof (optarg);
+	break;
+      case 's':
+	seed = strtoul (optarg, NULL, 0);
+	break;
+      default:
+	usage (argv[0]);
+      }
+  if (optind != argc || nthreads < 1 || nrequests < 1 || depth < 0
+      || ncleanups < 0 || failure_rate < 0 || failure_rate > 1)
+    usage (argv[0]);
+
+  workers = calloc (nthreads, sizeof (*workers));
+  if (workers == NULL)
+    {
+      perror ("load-test");
+      return EXIT_FAILURE;
+    }
+  for (i = 0; i < nthreads; i++)
+    {
+      workers[i].rand_state = seed + i * 2654435761U;
+      if (workers[i].rand_state == 0)
+	workers[i].rand_state = 1;
+      workers[i].ok_ns = malloc (nrequests * sizeof (unsigned long long));
+      workers[i].error_ns = malloc (nrequests * sizeof (unsigned long long));
+      if (workers[i].ok_ns == NULL || workers[i].error_ns == NULL)
+	{
+	  perror ("load-test");
+	  return EXIT_FAILURE;
+	}
+    }
+
+  start = now_ns ();
+  for (i = 0; i < nthreads; i++)
+    {
+      int err = pthread_create (&workers[i].thread, NULL, worker_main,
+				&workers[i]);
+
+      if (err != 0)
+	{
+	  fprintf (stderr, "load-test: %s\n", strerror (err));
+	  return EXIT_FAILURE;
+	}
+    }
+  for (i = 0; i < nthreads; i++)
+    pthread_join (workers[i].thread, NULL);
+  elapsed = now_ns () - start;
+
+  /* Merge the samples of all the workers.  */
+  ok_ns = malloc (nthreads * nrequests * sizeof (unsigned long long));
+  error_ns = malloc (nthreads * nrequests * sizeof (unsigned long long));
+  if (ok_ns == NULL || error_ns == NULL)
+    {
+      perror ("load-test");
+      return EXIT_FAILURE;
+    }
+  for (i = 0; i < nthreads; i++)
+    {
+      memcpy (ok_ns + nok, workers[i].ok_ns,
+	      workers[i].nok * sizeof (unsigned long long));
+      nok += workers[i].nok;
+      memcpy (error_ns + nerror, workers[i].error_ns,
+	      workers[i].nerror * sizeof (unsigned long long));
+      nerror += workers[i].nerror;
+    }
+
+  getrusage (RUSAGE_SELF, &usage_self);
+
+  printf ("threads %d, depth %d, cleanups %d per level, failure rate %g\n",
+	  nthreads, depth, ncleanups, failure_rate);
+  printf ("throughput %.0f requests/s\n",
+	  (double) (nok + nerror) * 1e9 / elapsed);
+  report_latencies ("ok", ok_ns, nok);
+  report_latencies ("error", error_ns, nerror);
+  printf ("peak rss %ld KiB\n", usage_self.ru_maxrss);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+/* Lock-aware unwinding for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* The mutexes locked with cexcept_lock are kept in a per-thread
+   array, oldest first, and cexcept_lock_count says how many there
+   are.  Each catcher notes the count when its TRY block is entered;
+   throw_exception, once it has done the cleanups of a block it leaves,
+   calls cexcept_release_locks to unlock those taken since.  Taking and
+   releasing a lock thus costs a store and an increment or decrement,
+   where a cleanup per lock would cost an allocation and a free.
+
+   A lock released out of order is removed from the array if it was
+   taken in the current TRY block, and the locks above it moved down.
+   One taken in an enclosing block is only marked released, with a
+   NULL mutex: removing it would bring the count under the current
+   catcher's, and the locks of the current block would no longer be
+   released if it is left by an exception.  Marked entries at the top
+   of the array are dropped as the blocks they belong to are left.  */
+
+#include "config.h"
+
+#include "exceptions.h"
+#include "locks.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "libcexcept-private.h"
+
+struct held_lock
+{
+  pthread_mutex_t *mutex;
+  /* When it was taken, if accounting was on then; otherwise zero.  */
+  unsigned long long acquired;
+};
+
+static CEXCEPT_THREAD struct held_lock held_locks[CEXCEPT_LOCKS_MAX];
+CEXCEPT_THREAD int cexcept_lock_count;
+
+/* Non-zero while accounting is on.  */
+static int lock_accounting;
+
+static CEXCEPT_THREAD struct cexcept_lock_stats lock_stats;
+
+/* Account for HELD being released, by an exception if UNWOUND is
+   non-zero.  */
+
+static void
+note_lock_released (const struct held_lock *held, int unwound)
+{
+  unsigned long long ns;
+
+  if (unwound)
+    lock_stats.unwound++;
+  if (held->acquired == 0)
+    return;
+
+  ns = cexcept_region_now () - held->acquired;
+  lock_stats.hold_ns += ns;
+  if (ns > lock_stats.max_hold_ns)
+    lock_stats.max_hold_ns = ns;
+  if (unwound)
+    lock_stats.unwound_hold_ns += ns;
+}
+
+CEXCEPT_EXPORT int
+cexcept_lock (pthread_mutex_t *mutex)
+{
+  unsigned long long acquired = 0;
+  int err;
+
+  if (cexcept_lock_count == CEXCEPT_LOCKS_MAX)
+    cexcept_throw_error (-ENOLCK, "more than %d locks held",
+			 CEXCEPT_LOCKS_MAX);
+
+  if (__builtin_expect (__atomic_load_n (&lock_accounting,
+					 __ATOMIC_RELAXED), 0))
+    {
+      unsigned long long start = cexcept_region_now ();
+
+      err = pthread_mutex_trylock (mutex);
+      if (err == EBUSY)
+	{
+	  lock_stats.contended++;
+	  err = pthread_mutex_lock (mutex);
+	}
+      acquired = cexcept_region_now ();
+      lock_stats.wait_ns += acquired - start;
+    }
+  else
+    err = pthread_mutex_lock (mutex);
+
+  /* The owner of a robust mutex died holding it: the mutex is ours,
+     for the caller to make consistent.  */
+  if (err != 0 && err != EOWNERDEAD)
+    cexcept_throw_error (-err, "pthread_mutex_lock: %s", strerror (err));
+
+  held_locks[cexcept_lock_count].mutex = mutex;
+  held_locks[cexcept_lock_count].acquired = acquired;
+  cexcept_lock_count++;
+  lock_stats.acquired++;
+  return err;
+}
+
+CEXCEPT_EXPORT void
+cexcept_unlock (pthread_mutex_t *mutex)
+{
+  int floor, i;
+
+  for (i = cexcept_lock_count - 1; i >= 0; i--)
+    if (held_locks[i].mutex == mutex)
+      break;
+  assert (i >= 0);
+
+  note_lock_released (&held_locks[i], 0);
+  floor = cexcept_catcher_lock_count ();
+  if (i >= floor)
+    {
+      cexcept_lock_count--;
+      memmove (&held_locks[i], &held_locks[i + 1],
+	       (cexcept_lock_count - i) * sizeof (held_locks[0]));
+      while (cexcept_lock_count > floor
+	     && held_locks[cexcept_lock_count - 1].mutex == NULL)
+	cexcept_lock_count--;
+    }
+  else
+    held_locks[i].mutex = NULL;
+  pthread_mutex_unlock (mutex);
+}
+
+/* Unlock the mutexes locked since the calling thread held COUNT,
+   newest first.  */
+
+void
+cexcept_release_locks (int count)
+{
+  while (cexcept_lock_count > count)
+    {
+      struct held_lock *held = &held_locks[--cexcept_lock_count];
+
+      if (held->mutex == NULL)
+	continue;
+      note_lock_released (held, 1);
+      pthread_mutex_unlock (held->mutex);
+    }
+}
+
+CEXCEPT_EXPORT int
+cexcept_set_lock_accounting (int enable)
+{
+  return __atomic_exchange_n (&lock_accounting, enable != 0,
+			      __ATOMIC_RELAXED);
+}
+
+CEXCEPT_EXPORT void
+cexcept_get_lock_stats (struct cexcept_lock_stats *stats)
+{
+  *stats = lock_stats;
+}
+
+CEXCEPT_EXPORT void
+cexcept_reset_lock_stats (void)
+{
+  memset (&lock_stats, 0, sizeof (lock_stats));
+}
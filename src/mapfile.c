@@ -0,0 +1,266 @@
+/* Memory-mapped file reading for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* The mappings made by cexcept_map_file are registered in a table
+   that the SIGBUS handler searches for the faulting address.  Slots
+   are claimed and released with atomic operations, so that the
+   handler, which may interrupt a thread at any point, never needs a
+   lock.  A fault in a registered mapping, in the thread that made it
+   and within a TRY block, is thrown as an error from the handler.
+   The signal is synchronous, raised by the code reading the mapping,
+   so the throw leaves that code as an error it threw itself would;
+   this holds only as long as that code is the caller's, not a libc
+   function that may hold locks or half-updated state, as documented
+   in mapfile.h.
+
+   The cleanup is made before the file is opened, and filled in once
+   it is mapped, so that no failure can leave the mapping or its slot
+   behind.  The handler is installed with SA_NODEFER, so that SIGBUS
+   is not left blocked after the long jump when the TRY backend does
+   not restore the signal mask.  */
+
+#include "config.h"
+
+#include "exceptions.h"
+#include "cleanups.h"
+#include "mapfile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libcexcept-private.h"
+
+/* The most mappings covered by the SIGBUS handler at once.  Mappings
+   made while the table is full work, but are not covered.  */
+#define MAP_TABLE_SIZE 256
+
+struct map_slot
+{
+  char *addr;
+  size_t len;
+  /* The thread that mapped it, on whose cleanup chain it is.  */
+  pthread_t owner;
+};
+
+static struct map_slot map_table[MAP_TABLE_SIZE];
+
+/* The SIGBUS disposition before ours.  */
+static struct sigaction map_old_sigbus;
+
+static pthread_once_t map_once = PTHREAD_ONCE_INIT;
+
+/* The argument of the cleanup of a mapping.  ADDR is NULL until the
+   file is mapped.  SLOT is its index in map_table, or -1 if it is not
+   covered.  */
+
+struct map_mapping
+{
+  void *addr;
+  size_t len;
+  int slot;
+};
+
+/* Return non-zero if ADDR is in a mapping registered by the calling
+   thread.  */
+
+static int
+map_covers (const char *addr)
+{
+  int i;
+
+  for (i = 0; i < MAP_TABLE_SIZE; i++)
+    {
+      char *start = __atomic_load_n (&map_table[i].addr, __ATOMIC_ACQUIRE);
+      size_t len = __atomic_load_n (&map_table[i].len, __ATOMIC_ACQUIRE);
+      pthread_t owner;
+
+      if (start == NULL || addr < start || addr >= start + len)
+	continue;
+      __atomic_load (&map_table[i].owner, &owner, __ATOMIC_RELAXED);
+      return pthread_equal (owner, pthread_self ());
+    }
+  return 0;
+}
+
+static void
+map_sigbus_handler (int sig, siginfo_t *info, void *context)
+{
+  static const struct cexception truncated =
+    { RETURN_ERROR, -EIO, "mapped file truncated under a read", NULL };
+
+  /* Only the thread that made the mapping has it on its cleanup chain,
+     and it can only be unwound from within a TRY block.  */
+  if (map_covers (info->si_addr) && cexcept_catcher_active ())
+    cexcept_throw (truncated);
+
+  /* Not ours.  */
+  if ((map_old_sigbus.sa_flags & SA_SIGINFO) != 0)
+    (*map_old_sigbus.sa_sigaction) (sig, info, context);
+  else if (map_old_sigbus.sa_handler != SIG_DFL
+	   && map_old_sigbus.sa_handler != SIG_IGN)
+    (*map_old_sigbus.sa_handler) (sig);
+  else
+    {
+      /* Let the access fault again, with the default action.  */
+      struct sigaction dfl;
+
+      memset (&dfl, 0, sizeof (dfl));
+      dfl.sa_handler = SIG_DFL;
+      sigemptyset (&dfl.sa_mask);
+      sigaction (SIGBUS, &dfl, NULL);
+    }
+}
+
+static void
+map_install_handler (void)
+{
+  struct sigaction action;
+
+  memset (&action, 0, sizeof (action));
+  action.sa_sigaction = map_sigbus_handler;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGBUS, &action, &map_old_sigbus);
+}
+
+/* Register the LEN bytes at ADDR with the SIGBUS handler, as mapped by
+   the calling thread, and return the slot used, or -1.  LEN is stored
+   last: until then, the slot covers nothing.  */
+
+static int
+map_register (void *addr, size_t len)
+{
+  int i;
+
+  for (i = 0; i < MAP_TABLE_SIZE; i++)
+    {
+      char *expected = NULL;
+
+      if (__atomic_compare_exchange_n (&map_table[i].addr, &expected,
+				       (char *) addr, 0, __ATOMIC_ACQ_REL,
+				       __ATOMIC_RELAXED))
+	{
+	  pthread_t self = pthread_self ();
+
+	  __atomic_store (&map_table[i].owner, &self, __ATOMIC_RELAXED);
+	  __atomic_store_n (&map_table[i].len, len, __ATOMIC_RELEASE);
+	  return i;
+	}
+    }
+  return -1;
+}
+
+static void
+map_file_cleanup (void *arg)
+{
+  struct map_mapping *mapping = arg;
+
+  if (mapping->addr == NULL)
+    return;
+  if (mapping->slot >= 0)
+    {
+      __atomic_store_n (&map_table[mapping->slot].len, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&map_table[mapping->slot].addr, NULL,
+			__ATOMIC_RELEASE);
+    }
+  munmap (mapping->addr, mapping->len);
+}
+
+/* Throw the error of the system call that failed on PATH.  */
+
+static void ATTRIBUTE_NORETURN
+map_throw_errno (const char *path)
+{
+  int err = errno;
+
+  cexcept_throw_error (-err, "%s: %s", path, strerror (err));
+}
+
+CEXCEPT_EXPORT const void *
+cexcept_map_file (const char *path, size_t *len)
+{
+  struct cexcept_cleanup *old_chain;
+  struct map_mapping *mapping;
+  struct stat st;
+  long page_size;
+  void *addr;
+  int fd;
+
+  pthread_once (&map_once, map_install_handler);
+
+  {
+    struct map_mapping unmapped = { NULL, 0, -1 };
+
+    old_chain = cexcept_make_cleanup_inline (map_file_cleanup, &unmapped,
+					     sizeof (unmapped));
+    mapping = cexcept_newest_cleanup_arg ();
+  }
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    map_throw_errno (path);
+  if (fstat (fd, &st) != 0)
+    {
+      int err = errno;
+
+      close (fd);
+      errno = err;
+      map_throw_errno (path);
+    }
+
+  *len = st.st_size;
+  if (st.st_size == 0)
+    {
+      close (fd);
+      cexcept_discard_cleanups (old_chain);
+      return NULL;
+    }
+
+  addr = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED)
+    {
+      int err = errno;
+
+      close (fd);
+      errno = err;
+      map_throw_errno (path);
+    }
+  close (fd);
+  mapping->len = st.st_size;
+  mapping->addr = addr;
+
+  madvise (mapping->addr, mapping->len, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise (mapping->addr, mapping->len, MADV_HUGEPAGE);
+#endif
+
+  /* The whole last page faults once the file shrinks, not just the
+     bytes that were in the file.  */
+  page_size = sysconf (_SC_PAGESIZE);
+  mapping->slot = map_register (mapping->addr,
+				(mapping->len + page_size - 1)
+				& ~(size_t) (page_size - 1));
+
+  return mapping->addr;
+}
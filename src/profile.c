@@ -0,0 +1,385 @@
+/* Unwind cost profiling for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Each throw is timed from its entry point until control lands in
+   the catcher that handles it.  Within that window, the time spent
+   formatting the message, in each cleanup function, and in each long
+   jump is recorded separately, so that the report can show a throw
+   site's cost broken down by cause.  Timestamps come from
+   CLOCK_MONOTONIC, which is served by the vDSO on Linux and does not
+   enter the kernel.
+
+   Samples are aggregated in a fixed-size open-addressing table keyed
+   by (kind, throw site, cleanup function); when it fills up, further
+   new keys are counted as dropped.  */
+
+#include "config.h"
+
+#include "profile.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_DLADDR
+#include <dlfcn.h>
+#endif
+
+#include "libcexcept-private.h"
+
+#if defined ENABLE_PROFILING || defined ENABLE_LEAK_CHECK
+
+/* Print a symbolic name for ADDR to STREAM, as "symbol+0xoffset" when
+   the symbol is known, "module+0xoffset" otherwise.  Semicolons and
+   spaces would break the folded format, but cannot appear in either
+   form.  */
+
+void
+cexcept_print_address (FILE *stream, const void *addr)
+{
+#ifdef HAVE_DLADDR
+  Dl_info info;
+
+  if (dladdr (addr, &info) != 0)
+    {
+      if (info.dli_sname != NULL)
+	{
+	  unsigned long offset
+	    = (unsigned long) addr - (unsigned long) info.dli_saddr;
+
+	  if (offset == 0)
+	    fputs (info.dli_sname, stream);
+	  else
+	    fprintf (stream, "%s+0x%lx", info.dli_sname, offset);
+	  return;
+	}
+      if (info.dli_fname != NULL)
+	{
+	  const char *base = strrchr (info.dli_fname, '/');
+
+	  fprintf (stream, "%s+0x%lx",
+		   base != NULL ? base + 1 : info.dli_fname,
+		   (unsigned long) addr - (unsigned long) info.dli_fbase);
+	  return;
+	}
+    }
+#endif
+  fprintf (stream, "%p", addr);
+}
+
+#endif
+
+#ifdef ENABLE_PROFILING
+
+/* What a table entry measures.  */
+enum profile_kind
+{
+  /* A whole throw, from entry to landing.  */
+  PROFILE_THROW,
+  /* Formatting the message of a throw.  */
+  PROFILE_FORMAT,
+  /* A cleanup function.  */
+  PROFILE_CLEANUP,
+  /* A long jump to a catcher.  */
+  PROFILE_LONGJMP
+};
+
+struct profile_entry
+{
+  enum profile_kind kind;
+  /* The throw site this is attributed to, or NULL for cleanups run
+     outside a throw.  */
+  const void *site;
+  /* The cleanup function, for PROFILE_CLEANUP.  */
+  const void *function;
+  unsigned long count;
+  unsigned long long total;
+};
+
+#define PROFILE_TABLE_SIZE 4096
+
+/* The table is shared by all threads, and protected by
+   PROFILE_LOCK.  */
+static struct profile_entry profile_table[PROFILE_TABLE_SIZE];
+static int profile_table_used;
+static unsigned long profile_dropped;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The calling thread's throw in progress.  */
+static CEXCEPT_THREAD int profile_in_throw;
+static CEXCEPT_THREAD const void *profile_site;
+static CEXCEPT_THREAD unsigned long long profile_throw_start;
+static CEXCEPT_THREAD unsigned long long profile_format_start;
+static CEXCEPT_THREAD unsigned long long profile_jump_start;
+
+unsigned long long
+cexcept_profile_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void profile_atexit (void);
+
+/* Arrange for the CEXCEPT_PROFILE report the first time anything is
+   recorded.  Called with PROFILE_LOCK held.  */
+
+static void
+profile_init (void)
+{
+  static int initialized;
+
+  if (initialized)
+    return;
+  initialized = 1;
+
+  if (getenv ("CEXCEPT_PROFILE") != NULL)
+    atexit (profile_atexit);
+}
+
+static void
+profile_record (enum profile_kind kind, const void *site,
+		const void *function, unsigned long long elapsed)
+{
+  unsigned long hash;
+  int i;
+
+  pthread_mutex_lock (&profile_lock);
+  profile_init ();
+
+  hash = ((unsigned long) site * 31 + (unsigned long) function) * 2654435761UL
+	 + kind;
+  for (i = 0; i < PROFILE_TABLE_SIZE; i++)
+    {
+      struct profile_entry *entry
+	= &profile_table[(hash + i) % PROFILE_TABLE_SIZE];
+
+      if (entry->count == 0)
+	{
+	  if (profile_table_used >= PROFILE_TABLE_SIZE / 2)
+	    break;
+	  profile_table_used++;
+	  entry->kind = kind;
+	  entry->site = site;
+	  entry->function = function;
+	}
+      else if (entry->kind != kind
+	       || entry->site != site
+	       || entry->function != function)
+	continue;
+
+      entry->count++;
+      entry->total += elapsed;
+      pthread_mutex_unlock (&profile_lock);
+      return;
+    }
+
+  profile_dropped++;
+  pthread_mutex_unlock (&profile_lock);
+}
+
+void
+cexcept_profile_throw_begin (const void *site)
+{
+  profile_in_throw = 1;
+  profile_site = site;
+  profile_throw_start = cexcept_profile_now ();
+}
+
+void
+cexcept_profile_format_begin (void)
+{
+  profile_format_start = cexcept_profile_now ();
+}
+
+void
+cexcept_profile_format_end (void)
+{
+  if (profile_in_throw)
+    profile_record (PROFILE_FORMAT, profile_site, NULL,
+		    cexcept_profile_now () - profile_format_start);
+}
+
+void
+cexcept_profile_jump (void)
+{
+  profile_jump_start = cexcept_profile_now ();
+}
+
+void
+cexcept_profile_landed (int handled)
+{
+  unsigned long long now;
+
+  if (!profile_in_throw)
+    return;
+
+  now = cexcept_profile_now ();
+  profile_record (PROFILE_LONGJMP, profile_site, NULL,
+		  now - profile_jump_start);
+  if (handled)
+    {
+      profile_record (PROFILE_THROW, profile_site, NULL,
+		      now - profile_throw_start);
+      profile_in_throw = 0;
+    }
+}
+
+void
+cexcept_profile_call_cleanup (void (*function) (void *), void *arg)
+{
+  const void *site = profile_in_throw ? profile_site : NULL;
+  unsigned long long start = cexcept_profile_now ();
+
+  (*function) (arg);
+  profile_record (PROFILE_CLEANUP, site, (const void *) function,
+		  cexcept_profile_now () - start);
+}
+
+/* A report line: an entry and the self time to report for it.  */
+
+struct profile_line
+{
+  const struct profile_entry *entry;
+  unsigned long long self;
+};
+
+static int
+compare_profile_lines (const void *a, const void *b)
+{
+  const struct profile_line *la = a;
+  const struct profile_line *lb = b;
+
+  if (la->self != lb->self)
+    return la->self < lb->self ? 1 : -1;
+  return 0;
+}
+
+CEXCEPT_EXPORT void
+cexcept_profile_dump (FILE *stream)
+{
+  struct profile_line *lines;
+  int i, j, n = 0;
+
+  lines = malloc (PROFILE_TABLE_SIZE * sizeof (*lines));
+  if (lines == NULL)
+    return;
+
+  pthread_mutex_lock (&profile_lock);
+
+  for (i = 0; i < PROFILE_TABLE_SIZE; i++)
+    if (profile_table[i].count != 0)
+      {
+	lines[n].entry = &profile_table[i];
+	lines[n].self = profile_table[i].total;
+	n++;
+      }
+
+  /* A throw's self time is what its children do not account for.  */
+  for (i = 0; i < n; i++)
+    if (lines[i].entry->kind == PROFILE_THROW)
+      for (j = 0; j < n; j++)
+	if (j != i && lines[j].entry->site == lines[i].entry->site)
+	  {
+	    if (lines[j].self > lines[i].self)
+	      lines[i].self = 0;
+	    else
+	      lines[i].self -= lines[j].self;
+	  }
+
+  qsort (lines, n, sizeof (*lines), compare_profile_lines);
+
+  for (i = 0; i < n; i++)
+    {
+      const struct profile_entry *entry = lines[i].entry;
+
+      if (entry->site != NULL)
+	{
+	  fputs ("cexcept_throw;", stream);
+	  cexcept_print_address (stream, entry->site);
+	}
+      else
+	fputs ("cexcept_do_cleanups", stream);
+
+      switch (entry->kind)
+	{
+	case PROFILE_THROW:
+	  break;
+	case PROFILE_FORMAT:
+	  fputs (";format", stream);
+	  break;
+	case PROFILE_CLEANUP:
+	  fputc (';', stream);
+	  cexcept_print_address (stream, entry->function);
+	  break;
+	case PROFILE_LONGJMP:
+	  fputs (";longjmp", stream);
+	  break;
+	}
+      fprintf (stream, " %llu\n", lines[i].self);
+    }
+
+  if (profile_dropped != 0)
+    fprintf (stderr, "libcexcept: profile table full, %lu samples dropped\n",
+	     profile_dropped);
+
+  pthread_mutex_unlock (&profile_lock);
+  free (lines);
+}
+
+CEXCEPT_EXPORT void
+cexcept_profile_reset (void)
+{
+  pthread_mutex_lock (&profile_lock);
+  memset (profile_table, 0, sizeof (profile_table));
+  profile_table_used = 0;
+  profile_dropped = 0;
+  pthread_mutex_unlock (&profile_lock);
+}
+
+static void
+profile_atexit (void)
+{
+  const char *path = getenv ("CEXCEPT_PROFILE");
+  FILE *stream;
+
+  if (path == NULL)
+    return;
+
+  stream = fopen (path, "w");
+  if (stream == NULL)
+    return;
+  cexcept_profile_dump (stream);
+  fclose (stream);
+}
+
+#else /* ENABLE_PROFILING */
+
+CEXCEPT_EXPORT void
+cexcept_profile_dump (FILE *stream)
+{
+}
+
+CEXCEPT_EXPORT void
+cexcept_profile_reset (void)
+{
+}
+
+#endif /* ENABLE_PROFILING */
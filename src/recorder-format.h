@@ -0,0 +1,86 @@
+/* Exception flight recorder file format.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Shared between the recorder in the library and cexcept-dump.
+
+   A recorder file is a struct recorder_header, followed by NRINGS
+   struct recorder_ring, followed by NRINGS arrays of RING_RECORDS
+   struct recorder_record each.  Every thread that throws claims a
+   ring of its own and writes to it without synchronization; a
+   record's SEQ is stored last, so a reader can tell a complete record
+   from one that was being written.  All fields are in the byte order
+   of the writing machine.  */
+
+#ifndef RECORDER_FORMAT_H
+#define RECORDER_FORMAT_H
+
+#include <stdint.h>
+
+#define RECORDER_MAGIC "CEXREC\0\0"
+#define RECORDER_VERSION 1
+
+/* The longest message kept, including the terminating NUL.  */
+#define RECORDER_MESSAGE_SIZE 88
+
+struct recorder_header
+{
+  char magic[8];
+  uint32_t version;
+  /* sizeof (struct recorder_record), as a sanity check.  */
+  uint32_t record_size;
+  /* Records per ring, a power of two.  */
+  uint32_t ring_records;
+  /* Number of rings in the file.  */
+  uint32_t nrings;
+  /* Number of rings claimed so far.  May exceed NRINGS, in which case
+     the threads that came too late record nothing.  */
+  uint32_t rings_used;
+  /* The recording process.  */
+  uint32_t pid;
+  char pad[32];
+};
+
+struct recorder_ring
+{
+  /* Number of records written to this ring, ever.  The most recent
+     one is at index (HEAD - 1) % RING_RECORDS.  */
+  uint64_t head;
+  /* The thread writing to this ring.  */
+  uint32_t tid;
+  char pad[52];
+};
+
+struct recorder_record
+{
+  /* The value of HEAD at the time this record was started, plus
+     one.  */
+  uint64_t seq;
+  /* CLOCK_REALTIME, in nanoseconds.  */
+  uint64_t timestamp;
+  /* The address the exception was thrown from.  */
+  uint64_t pc;
+  int32_t reason;
+  int32_t error;
+  /* The number of nested catchers when the exception was thrown.  */
+  int32_t depth;
+  /* The length of the full message; MESSAGE holds at most
+     RECORDER_MESSAGE_SIZE - 1 bytes of it.  */
+  uint32_t message_len;
+  char message[RECORDER_MESSAGE_SIZE];
+};
+
+#endif /* RECORDER_FORMAT_H */
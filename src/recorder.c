@@ -0,0 +1,199 @@
+/* Exception flight recorder for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+#include "config.h"
+
+#include "exceptions.h"
+#include "recorder.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "recorder-format.h"
+#include "libcexcept-private.h"
+
+/* The mapped file, or NULL when not recording.  */
+struct recorder_header *cexcept_recorder;
+
+/* The size of the mapping at cexcept_recorder.  */
+static size_t recorder_size;
+
+/* Bumped on every open, once cexcept_recorder is set, so that threads
+   notice their ring is stale.  */
+static unsigned int recorder_generation;
+
+/* This thread's ring, valid if recorder_ring_generation matches
+   recorder_generation.  NULL if there was no ring left for it.
+   RECORDER_RING_MASK is the number of records in it, less one.  */
+static CEXCEPT_THREAD struct recorder_ring *recorder_ring;
+static CEXCEPT_THREAD struct recorder_record *recorder_ring_records;
+static CEXCEPT_THREAD uint64_t recorder_ring_mask;
+static CEXCEPT_THREAD unsigned int recorder_ring_generation;
+
+CEXCEPT_EXPORT int
+cexcept_recorder_open (const char *path, unsigned int records,
+		       unsigned int threads)
+{
+  struct recorder_header *header;
+  unsigned int ring_records = 1;
+  size_t ring_size, size;
+  void *map;
+  int fd;
+
+  if (records == 0 || threads == 0 || records > (1U << 24))
+    return -EINVAL;
+  while (ring_records < records)
+    ring_records <<= 1;
+
+  /* At most 2 GiB and a little, so this does not overflow, but the
+     size of the whole file may, or may be too large for an off_t.  */
+  ring_size = (sizeof (struct recorder_ring)
+	       + (size_t) ring_records * sizeof (struct recorder_record));
+  if (threads > (SIZE_MAX - sizeof (struct recorder_header)) / ring_size)
+    return -EINVAL;
+  size = sizeof (struct recorder_header) + threads * ring_size;
+  if ((off_t) size < 0 || (size_t) (off_t) size != size)
+    return -EINVAL;
+
+  fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -errno;
+  if (ftruncate (fd, size) != 0)
+    {
+      int ret = -errno;
+
+      close (fd);
+      return ret;
+    }
+  map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -errno;
+
+  header = map;
+  header->version = RECORDER_VERSION;
+  header->record_size = sizeof (struct recorder_record);
+  header->ring_records = ring_records;
+  header->nrings = threads;
+  header->rings_used = 0;
+  header->pid = getpid ();
+  /* The magic goes last, so that a reader never sees a half-written
+     header.  */
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  memcpy (header->magic, RECORDER_MAGIC, sizeof (header->magic));
+
+  /* Publish the header before the generation, so that a thread that
+     sees the new generation claims its ring from the new header.  */
+  cexcept_recorder_close ();
+  recorder_size = size;
+  __atomic_store_n (&cexcept_recorder, header, __ATOMIC_RELEASE);
+  __atomic_add_fetch (&recorder_generation, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+CEXCEPT_EXPORT void
+cexcept_recorder_close (void)
+{
+  struct recorder_header *header
+    = __atomic_exchange_n (&cexcept_recorder, NULL, __ATOMIC_ACQ_REL);
+
+  if (header != NULL)
+    munmap (header, recorder_size);
+}
+
+/* Claim a ring of the recorder of generation GENERATION for the
+   calling thread, if any are left.  */
+
+static void
+recorder_claim_ring (unsigned int generation)
+{
+  struct recorder_header *header
+    = __atomic_load_n (&cexcept_recorder, __ATOMIC_ACQUIRE);
+  struct recorder_ring *rings;
+  unsigned int index;
+
+  recorder_ring_generation = generation;
+  recorder_ring = NULL;
+  if (header == NULL)
+    return;
+  rings = (struct recorder_ring *) (header + 1);
+
+  index = __atomic_fetch_add (&header->rings_used, 1, __ATOMIC_RELAXED);
+  if (index >= header->nrings)
+    return;
+
+  recorder_ring = &rings[index];
+  recorder_ring->tid = syscall (SYS_gettid);
+  recorder_ring_records
+    = ((struct recorder_record *) (rings + header->nrings)
+       + (size_t) index * header->ring_records);
+  recorder_ring_mask = header->ring_records - 1;
+}
+
+void
+cexcept_recorder_record (const struct cexception *exception,
+			 const void *site, int depth)
+{
+  unsigned int generation
+    = __atomic_load_n (&recorder_generation, __ATOMIC_ACQUIRE);
+  struct recorder_record *record;
+  struct timespec ts;
+  uint64_t head;
+  size_t len;
+
+  if (recorder_ring_generation != generation)
+    recorder_claim_ring (generation);
+  if (recorder_ring == NULL)
+    return;
+
+  head = recorder_ring->head;
+  record = &recorder_ring_records[head & recorder_ring_mask];
+
+  /* Invalidate the slot while it is being rewritten.  */
+  __atomic_store_n (&record->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+
+  clock_gettime (CLOCK_REALTIME, &ts);
+  record->timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  record->pc = (uintptr_t) site;
+  record->reason = exception->reason;
+  record->error = exception->error;
+  record->depth = depth;
+
+  len = 0;
+  if (exception->message != NULL)
+    {
+      len = strlen (exception->message);
+      record->message_len = len;
+      if (len >= RECORDER_MESSAGE_SIZE)
+	len = RECORDER_MESSAGE_SIZE - 1;
+      memcpy (record->message, exception->message, len);
+    }
+  else
+    record->message_len = 0;
+  record->message[len] = '\0';
+
+  __atomic_store_n (&record->seq, head + 1, __ATOMIC_RELEASE);
+  __atomic_store_n (&recorder_ring->head, head + 1, __ATOMIC_RELEASE);
+}
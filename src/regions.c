@@ -0,0 +1,398 @@
+/* Latency of named TRY regions for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Each thread has a table of its regions, keyed by the address of the
+   name, so that the same name given from different places may take
+   several entries; snapshots merge them by name.  A thread's entries
+   are only written by that thread, with relaxed atomic stores that
+   snapshots read with relaxed atomic loads.
+
+   The tables of all threads are on a list, protected by REGION_LOCK.
+   When a thread exits, its entries are merged into those of exited
+   threads, and its table is freed.  */
+
+#include "config.h"
+
+#include "regions.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libcexcept-private.h"
+
+/* Non-zero while recording.  */
+int cexcept_region_recording;
+
+/* The entries of a table.  */
+#define REGION_TABLE_SIZE 64
+
+/* Above 16 ns, each power of two is split in 1 << REGION_SUB_BITS
+   buckets, up to 2 ** (REGION_MAX_EXP + 1).  */
+#define REGION_SUB_BITS 4
+#define REGION_MAX_EXP 40
+
+struct region_table
+{
+  struct region_table *next;
+  struct region_table *prev;
+  struct cexcept_region_stats *entries[REGION_TABLE_SIZE];
+  /* The exits not recorded because the table was full.  */
+  unsigned long dropped;
+};
+
+/* The table of every thread that recorded, and the merged entries of
+   those that exited.  */
+static struct region_table *region_tables;
+static struct region_table region_exited;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The calling thread's table.  */
+static CEXCEPT_THREAD struct region_table *region_table;
+
+CEXCEPT_EXPORT int
+cexcept_set_region_recording (int enable)
+{
+  return __atomic_exchange_n (&cexcept_region_recording, enable != 0,
+			      __ATOMIC_RELAXED);
+}
+
+unsigned long long
+cexcept_region_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Return the bucket of NS.  */
+
+static int
+region_bucket (unsigned long long ns)
+{
+  int exp;
+
+  if (ns < (1 << REGION_SUB_BITS))
+    return ns;
+
+  exp = 63 - __builtin_clzll (ns);
+  if (exp > REGION_MAX_EXP)
+    return CEXCEPT_REGION_BUCKETS - 1;
+  return ((exp - REGION_SUB_BITS + 1) << REGION_SUB_BITS)
+	 + (int) ((ns >> (exp - REGION_SUB_BITS)) - (1 << REGION_SUB_BITS));
+}
+
+/* Return the largest value in BUCKET.  */
+
+static unsigned long long
+region_bucket_limit (int bucket)
+{
+  int exp, sub;
+
+  if (bucket < (1 << REGION_SUB_BITS))
+    return bucket;
+
+  exp = (bucket >> REGION_SUB_BITS) + REGION_SUB_BITS - 1;
+  sub = (bucket & ((1 << REGION_SUB_BITS) - 1)) + (1 << REGION_SUB_BITS);
+  return (((unsigned long long) sub + 1) << (exp - REGION_SUB_BITS)) - 1;
+}
+
+/* Add STATS to the entry of its name in INTO, a table only read or
+   written with REGION_LOCK held.  */
+
+static void
+region_merge (struct region_table *into,
+	      const struct cexcept_region_stats *stats)
+{
+  struct cexcept_region_stats *entry = NULL;
+  int i, j;
+
+  for (i = 0; i < REGION_TABLE_SIZE; i++)
+    {
+      entry = into->entries[i];
+      if (entry == NULL)
+	{
+	  entry = XZALLOC (struct cexcept_region_stats);
+	  entry->name = stats->name;
+	  into->entries[i] = entry;
+	  break;
+	}
+      if (strcmp (entry->name, stats->name) == 0)
+	break;
+      entry = NULL;
+    }
+
+  if (entry == NULL)
+    {
+      for (i = 0; i < CEXCEPT_REGION_EXITS; i++)
+	into->dropped += stats->exits[i].count;
+      return;
+    }
+
+  for (i = 0; i < CEXCEPT_REGION_EXITS; i++)
+    {
+      const struct cexcept_region_histogram *from = &stats->exits[i];
+      struct cexcept_region_histogram *to = &entry->exits[i];
+      unsigned long long max;
+
+      to->count += __atomic_load_n (&from->count, __ATOMIC_RELAXED);
+      to->total_ns += __atomic_load_n (&from->total_ns, __ATOMIC_RELAXED);
+      max = __atomic_load_n (&from->max_ns, __ATOMIC_RELAXED);
+      if (max > to->max_ns)
+	to->max_ns = max;
+      for (j = 0; j < CEXCEPT_REGION_BUCKETS; j++)
+	to->buckets[j] += __atomic_load_n (&from->buckets[j],
+					   __ATOMIC_RELAXED);
+    }
+}
+
+/* Merge the calling thread's table into REGION_EXITED, at thread
+   exit.  */
+
+static void
+region_thread_exit (void *arg)
+{
+  struct region_table *table = region_table;
+  int i;
+
+  pthread_mutex_lock (&region_lock);
+  for (i = 0; i < REGION_TABLE_SIZE; i++)
+    if (table->entries[i] != NULL)
+      {
+	region_merge (&region_exited, table->entries[i]);
+	cexcept_xfree (table->entries[i]);
+      }
+  region_exited.dropped += table->dropped;
+
+  if (table->prev != NULL)
+    table->prev->next = table->next;
+  else
+    region_tables = table->next;
+  if (table->next != NULL)
+    table->next->prev = table->prev;
+  pthread_mutex_unlock (&region_lock);
+
+  cexcept_xfree (table);
+  region_table = NULL;
+}
+
+/* Return the calling thread's table, making it if need be.  */
+
+static struct region_table *
+region_get_table (void)
+{
+  struct region_table *table = region_table;
+
+  if (table != NULL)
+    return table;
+
+  table = XZALLOC (struct region_table);
+  pthread_mutex_lock (&region_lock);
+  table->next = region_tables;
+  if (region_tables != NULL)
+    region_tables->prev = table;
+  region_tables = table;
+  pthread_mutex_unlock (&region_lock);
+
+  region_table = table;
+  cexcept_make_thread_final_cleanup (region_thread_exit, NULL);
+  return table;
+}
+
+/* Store VALUE in *COUNTER, which only the calling thread writes.  */
+
+static inline void
+region_set (unsigned long *counter, unsigned long value)
+{
+  __atomic_store_n (counter, value, __ATOMIC_RELAXED);
+}
+
+static inline void
+region_set_ll (unsigned long long *counter, unsigned long long value)
+{
+  __atomic_store_n (counter, value, __ATOMIC_RELAXED);
+}
+
+/* Record that the calling thread left REGION, entered at START, the
+   way HOW says, a value of enum cexcept_region_exit.  */
+
+void
+cexcept_region_record (const char *region, int how,
+		       unsigned long long start)
+{
+  unsigned long long ns = cexcept_region_now () - start;
+  struct region_table *table = region_get_table ();
+  struct cexcept_region_histogram *histogram;
+  struct cexcept_region_stats *stats = NULL;
+  unsigned long hash;
+  int i;
+
+  hash = ((unsigned long) region >> 3) * 2654435761UL;
+  for (i = 0; i < REGION_TABLE_SIZE; i++)
+    {
+      struct cexcept_region_stats **entry
+	= &table->entries[(hash + i) % REGION_TABLE_SIZE];
+
+      if (*entry == NULL)
+	{
+	  stats = XZALLOC (struct cexcept_region_stats);
+	  stats->name = region;
+	  __atomic_store_n (entry, stats, __ATOMIC_RELEASE);
+	  break;
+	}
+      if ((*entry)->name == region)
+	{
+	  stats = *entry;
+	  break;
+	}
+    }
+
+  if (stats == NULL)
+    {
+      region_set (&table->dropped, table->dropped + 1);
+      return;
+    }
+
+  histogram = &stats->exits[how];
+  region_set (&histogram->count, histogram->count + 1);
+  region_set_ll (&histogram->total_ns, histogram->total_ns + ns);
+  if (ns > histogram->max_ns)
+    region_set_ll (&histogram->max_ns, ns);
+  i = region_bucket (ns);
+  region_set (&histogram->buckets[i], histogram->buckets[i] + 1);
+}
+
+CEXCEPT_EXPORT struct cexcept_region_stats *
+cexcept_region_snapshot (size_t *count, unsigned long *dropped)
+{
+  struct region_table merged;
+  struct cexcept_region_stats *stats;
+  struct region_table *table;
+  size_t n = 0;
+  int i;
+
+  memset (&merged, 0, sizeof (merged));
+
+  pthread_mutex_lock (&region_lock);
+  for (i = 0; i < REGION_TABLE_SIZE; i++)
+    if (region_exited.entries[i] != NULL)
+      region_merge (&merged, region_exited.entries[i]);
+  for (table = region_tables; table != NULL; table = table->next)
+    for (i = 0; i < REGION_TABLE_SIZE; i++)
+      {
+	struct cexcept_region_stats *entry
+	  = __atomic_load_n (&table->entries[i], __ATOMIC_ACQUIRE);
+
+	if (entry != NULL)
+	  region_merge (&merged, entry);
+      }
+  /* Exits dropped by the threads, and those of the regions that did
+     not fit in MERGED.  */
+  merged.dropped += region_exited.dropped;
+  for (table = region_tables; table != NULL; table = table->next)
+    merged.dropped += __atomic_load_n (&table->dropped, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&region_lock);
+
+  /* MERGED is filled in order, from its first entry.  */
+  while (n < REGION_TABLE_SIZE && merged.entries[n] != NULL)
+    n++;
+  stats = cexcept_xmalloc ((n ? n : 1) * sizeof (*stats));
+  for (i = 0; i < (int) n; i++)
+    {
+      stats[i] = *merged.entries[i];
+      cexcept_xfree (merged.entries[i]);
+    }
+
+  *count = n;
+  if (dropped != NULL)
+    *dropped = merged.dropped;
+  return stats;
+}
+
+CEXCEPT_EXPORT void
+cexcept_region_snapshot_free (struct cexcept_region_stats *stats)
+{
+  cexcept_xfree (stats);
+}
+
+CEXCEPT_EXPORT unsigned long long
+cexcept_region_percentile (const struct cexcept_region_histogram *histogram,
+			   double percentile)
+{
+  unsigned long long target, seen = 0;
+  int i;
+
+  if (histogram->count == 0)
+    return 0;
+
+  target = (unsigned long long) (percentile / 100 * histogram->count + 0.5);
+  if (target < 1)
+    target = 1;
+
+  for (i = 0; i < CEXCEPT_REGION_BUCKETS; i++)
+    {
+      seen += histogram->buckets[i];
+      if (seen >= target)
+	{
+	  unsigned long long limit = region_bucket_limit (i);
+
+	  return limit < histogram->max_ns ? limit : histogram->max_ns;
+	}
+    }
+  return histogram->max_ns;
+}
+
+CEXCEPT_EXPORT void
+cexcept_region_dump (FILE *stream)
+{
+  static const char *const exit_names[CEXCEPT_REGION_EXITS]
+    = { "normal", "exception" };
+  struct cexcept_region_stats *stats;
+  unsigned long dropped;
+  size_t n, i;
+  int how;
+
+  stats = cexcept_region_snapshot (&n, &dropped);
+
+  fprintf (stream, "%-24s %-9s %10s %10s %10s %10s %10s %10s\n",
+	   "region", "exit", "count", "mean ns", "p50 ns", "p99 ns",
+	   "p99.9 ns", "max ns");
+  for (i = 0; i < n; i++)
+    for (how = 0; how < CEXCEPT_REGION_EXITS; how++)
+      {
+	const struct cexcept_region_histogram *histogram
+	  = &stats[i].exits[how];
+
+	if (histogram->count == 0)
+	  continue;
+	fprintf (stream, "%-24s %-9s %10lu %10llu %10llu %10llu %10llu %10llu\n",
+		 stats[i].name, exit_names[how], histogram->count,
+		 histogram->total_ns / histogram->count,
+		 cexcept_region_percentile (histogram, 50),
+		 cexcept_region_percentile (histogram, 99),
+		 cexcept_region_percentile (histogram, 99.9),
+		 histogram->max_ns);
+      }
+
+  cexcept_region_snapshot_free (stats);
+
+  if (dropped != 0)
+    fprintf (stream, "# %lu exits dropped, over %d regions\n",
+	     dropped, REGION_TABLE_SIZE);
+}
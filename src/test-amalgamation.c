@@ -0,0 +1,54 @@
+/* GNU cexcept - C exception and cleanup mechanism.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* Check that the single-header amalgamation is self-contained: this
+   file is the whole program, with the library compiled in.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define CEXCEPT_IMPLEMENTATION
+#include "cexcept/amalgamation.h"
+
+static void
+count_cleanup (void *arg)
+{
+  int *count = arg;
+
+  (*count)++;
+}
+
+int
+main (int argc, char *argv[])
+{
+  volatile struct cexception e;
+  int count = 0;
+
+  CEXCEPT_TRY (e, RETURN_MASK_ERROR)
+    {
+      cexcept_make_cleanup (count_cleanup, &count);
+      cexcept_throw_error (1, "from the amalgamation");
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == 1);
+  assert (strcmp (e.message, "from the amalgamation") == 0);
+  assert (count == 1);
+
+  return EXIT_SUCCESS;
+}
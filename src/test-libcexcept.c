@@ -17,6 +17,7 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
@@ -24,6 +25,10 @@
 #include <errno.h>
 #include <unistd.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <cexcept/libcexcept.h>
 
@@ -31,6 +36,7 @@
 #define TRY_CATCH CEXCEPT_TRY
 #define throw_error cexcept_throw_error
 #define make_cleanup cexcept_make_cleanup
+#define make_cleanup_dtor cexcept_make_cleanup_dtor
 #define cleanup cexcept_cleanup
 #define do_cleanups cexcept_do_cleanups
 #define discard_cleanups cexcept_discard_cleanups
@@ -38,6 +44,9 @@
 /* Pull in application specific errors.  */
 #include "test-libcexcept.h"
 
+/* For checking the flight recorder's output.  */
+#include "recorder-format.h"
+
 /* Helper function which does the work for make_cleanup_fclose.  */
 
 static void
@@ -130,54 +139,1806 @@ test_realloc (int arg)
   return ret;
 }
 
-int
-main (int argc, char *argv[])
+/* Allocator hooks that count calls, so tests can check which paths
+   allocate.  */
+
+struct alloc_counts
+{
+  int allocs;
+  int reallocs;
+  int frees;
+};
+
+static void *
+counting_alloc (size_t size, void *ctx)
+{
+  struct alloc_counts *counts = ctx;
+
+  counts->allocs++;
+  return malloc (size);
+}
+
+static void *
+counting_realloc (void *ptr, size_t size, void *ctx)
+{
+  struct alloc_counts *counts = ctx;
+
+  counts->reallocs++;
+  return realloc (ptr, size);
+}
+
+static void
+counting_free (void *ptr, void *ctx)
+{
+  struct alloc_counts *counts = ctx;
+
+  counts->frees++;
+  free (ptr);
+}
+
+static void
+test_allocator (void)
 {
   volatile struct cexception e;
+  struct alloc_counts counts;
   struct cleanup *old_chain;
 
+  memset (&counts, 0, sizeof (counts));
+  cexcept_set_allocator (counting_alloc, counting_realloc, counting_free,
+			 &counts);
+
+  /* Doing or discarding an empty chain is allocation-free.  */
+  do_cleanups (cexcept_all_cleanups ());
+  discard_cleanups (cexcept_all_cleanups ());
+  assert (counts.allocs == 0 && counts.frees == 0);
+
+  /* One record per cleanup, released when the cleanup is done.  */
+  old_chain = make_cleanup (cexcept_null_cleanup, NULL);
+  assert (counts.allocs == 1);
+  do_cleanups (old_chain);
+  assert (counts.frees == 1);
+
+  /* The message goes through the hooks too.  The catcher is one
+     recycled from an earlier TRY.  */
   TRY_CATCH (e, RETURN_MASK_ERROR)
     {
-      test_fclose ();
+      throw_error (GENERIC_ERROR, "counted %d", 1);
     }
-  if (e.reason < 0)
+  assert (e.reason == RETURN_ERROR);
+  assert (strcmp (e.message, "counted 1") == 0);
+  assert (counts.allocs == 2);
+
+  cexcept_set_allocator (NULL, NULL, NULL, NULL);
+}
+
+/* With profiling enabled, a throw shows up in the report, with the
+   cleanup it ran underneath it.  */
+
+static void
+test_profile (void)
+{
+  volatile struct cexception e;
+  FILE *report;
+  char line[256];
+  int throws = 0, cleanups = 0;
+
+  cexcept_profile_reset ();
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
     {
-      fprintf (stderr, "caught: %s", e.message);
+      make_cleanup (cexcept_null_cleanup, NULL);
+      throw_error (GENERIC_ERROR, "profiled");
+    }
+  assert (e.reason == RETURN_ERROR);
+
+  report = tmpfile ();
+  assert (report != NULL);
+  cexcept_profile_dump (report);
+  rewind (report);
+  while (fgets (line, sizeof (line), report) != NULL)
+    {
+      if (strncmp (line, "cexcept_throw;", 14) != 0)
+	continue;
+      throws++;
+      if (strstr (line, "cexcept_null_cleanup") != NULL)
+	cleanups++;
     }
+  fclose (report);
+
+#ifdef ENABLE_PROFILING
+  assert (throws >= 3);
+  assert (cleanups == 1);
+#else
+  assert (throws == 0);
+#endif
+}
+
+/* Cleanup that appends the character ARG points to to cleanup_log.  */
+
+static char cleanup_log[32];
+
+static void
+log_cleanup (void *arg)
+{
+  const char *c = arg;
+
+  strncat (cleanup_log, c, 1);
+}
+
+static void
+log_dtor (void *arg)
+{
+  strcat (cleanup_log, "~");
+}
+
+static void
+test_transfer (void)
+{
+  volatile struct cexception e;
+  struct cleanup *dest = cexcept_all_cleanups ();
+  struct cleanup *old_chain;
+  struct cleanup *base;
+  struct cleanup *saved;
+
+  cleanup_log[0] = '\0';
+
+  base = make_cleanup (log_cleanup, "a");
+  old_chain = make_cleanup_dtor (log_cleanup, "b", log_dtor);
+  make_cleanup (log_cleanup, "c");
 
+  /* Move b and c, leaving a behind.  */
+  cexcept_transfer_cleanups (old_chain, &dest);
+  do_cleanups (base);
+  assert (strcmp (cleanup_log, "a") == 0);
+
+  /* A whole chain moves on top of what DEST already holds.  */
   TRY_CATCH (e, RETURN_MASK_ERROR)
     {
-      char *a;
+      make_cleanup (log_cleanup, "d");
+      make_cleanup (log_cleanup, "e");
+      cexcept_transfer_cleanups (cexcept_all_cleanups (), &dest);
+      throw_error (GENERIC_ERROR, "transferred cleanups survive");
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (strcmp (cleanup_log, "a") == 0);
 
-      a = malloc (10);
-      old_chain = make_cleanup (free, a);
+  /* DEST can become the cleanup chain, and be moved whole again: its
+     oldest cleanup is found although its cleanups came from two other
+     chains, one of them since done.  */
+  saved = cexcept_save_cleanups ();
+  cexcept_restore_cleanups (dest);
+  dest = cexcept_all_cleanups ();
+  cexcept_transfer_cleanups (cexcept_all_cleanups (), &dest);
+  assert (cexcept_save_cleanups () == cexcept_all_cleanups ());
+  cexcept_restore_cleanups (saved);
+
+  cexcept_do_chain_cleanups (&dest, cexcept_all_cleanups ());
+  assert (strcmp (cleanup_log, "aedcb~") == 0);
+  assert (dest == cexcept_all_cleanups ());
+}
+
+static void
+test_cancel (void)
+{
+  struct cexcept_cleanup_stats before, after;
+  struct cleanup *old_chain;
+  struct cleanup *handle;
+
+  cleanup_log[0] = '\0';
+
+  make_cleanup (log_cleanup, "a");
+  old_chain = cexcept_make_cancelable_cleanup (log_cleanup, "b", log_dtor,
+					       &handle);
+  make_cleanup (log_cleanup, "c");
+
+  /* The dtor runs when cancelled; c and a are left alone.  */
+  cexcept_cancel_cleanup (handle);
+  assert (strcmp (cleanup_log, "~") == 0);
+
+  do_cleanups (old_chain);
+  assert (strcmp (cleanup_log, "~c") == 0);
+  do_cleanups (cexcept_all_cleanups ());
+  assert (strcmp (cleanup_log, "~ca") == 0);
+
+  /* The newest cleanup, once cancelled, is off the chain.  */
+  make_cleanup (log_cleanup, "d");
+  cexcept_get_cleanup_stats (&before);
+  cexcept_make_cancelable_cleanup (log_cleanup, "e", log_dtor, &handle);
+  cexcept_cancel_cleanup (handle);
+  cexcept_get_cleanup_stats (&after);
+  assert (after.count == before.count);
+  do_cleanups (cexcept_all_cleanups ());
+  assert (strcmp (cleanup_log, "~ca~d") == 0);
+}
+
+/* An argument small enough to be copied into its cleanup.  */
+
+struct tagged_fd
+{
+  int fd;
+  char tag;
+};
+
+static void
+close_tagged_fd (void *arg)
+{
+  struct tagged_fd *tfd = arg;
+
+  close (tfd->fd);
+  strncat (cleanup_log, &tfd->tag, 1);
+}
+
+static void
+test_inline_cleanup (void)
+{
+  volatile struct cexception e;
+  struct alloc_counts counts;
+  struct tagged_fd tfd;
+  struct cleanup *old_chain;
+
+  cleanup_log[0] = '\0';
+  memset (&counts, 0, sizeof (counts));
+  cexcept_set_allocator (counting_alloc, counting_realloc, counting_free,
+			 &counts);
+
+  tfd.fd = open ("/dev/null", O_RDONLY);
+  assert (tfd.fd >= 0);
+  tfd.tag = 'f';
+  old_chain = cexcept_make_cleanup_inline (close_tagged_fd, &tfd,
+					   sizeof (tfd));
+  /* The cleanup has its own copy.  */
+  tfd.tag = 'x';
+  assert (counts.allocs == 1);
+
+  do_cleanups (old_chain);
+  assert (strcmp (cleanup_log, "f") == 0);
+  assert (counts.frees == 1);
+  assert (fcntl (tfd.fd, F_GETFD) == -1 && errno == EBADF);
+
+  /* An argument too large to copy is refused, whatever the build.  */
+  old_chain = cexcept_all_cleanups ();
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      char big[CEXCEPT_CLEANUP_INLINE_MAX + 1];
+
+      memset (big, 0, sizeof (big));
+      cexcept_make_cleanup_inline (cexcept_null_cleanup, big, sizeof (big));
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == -EINVAL);
+  assert (cexcept_all_cleanups () == old_chain);
+
+  cexcept_set_allocator (NULL, NULL, NULL, NULL);
+}
+
+/* Record the thread a deferred cleanup ran in.  */
+
+static void
+note_deferred_thread (void *arg)
+{
+  pthread_t *thread = arg;
+
+  *thread = pthread_self ();
+}
+
+static void
+test_deferred_cleanup (void)
+{
+  volatile struct cexception e;
+  pthread_t ran_in = pthread_self ();
+  pthread_t discarded = pthread_self ();
+  struct cleanup *old_chain;
 
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      old_chain = cexcept_make_cleanup_deferred (note_deferred_thread,
+						 &discarded);
       discard_cleanups (old_chain);
 
-      free (a);
+      cexcept_make_cleanup_deferred (note_deferred_thread, &ran_in);
+      throw_error (GENERIC_ERROR, "deferred");
     }
-  if (e.reason < 0)
+  assert (e.reason == RETURN_ERROR);
+
+  cexcept_drain_deferred ();
+  assert (!pthread_equal (ran_in, pthread_self ()));
+  assert (pthread_equal (discarded, pthread_self ()));
+}
+
+/* A thread that throws and catches on its own, and leaves a thread
+   final cleanup behind.  */
+
+static void *
+thread_final_main (void *arg)
+{
+  volatile struct cexception e;
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
     {
-      fprintf (stderr, "caught: %s", e.message);
-      return EXIT_SUCCESS;
+      make_cleanup (log_cleanup, "t");
+      throw_error (GENERIC_ERROR, "in thread");
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (strcmp (e.message, "in thread") == 0);
+
+  cexcept_make_thread_final_cleanup (log_cleanup, "f");
+  return NULL;
+}
+
+static void
+test_thread_final_cleanup (void)
+{
+  volatile struct cexception e;
+  pthread_t thread;
+
+  cleanup_log[0] = '\0';
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      make_cleanup (log_cleanup, "m");
+
+      /* The other thread's catchers and cleanups do not mix with
+	 these.  */
+      assert (pthread_create (&thread, NULL, thread_final_main, NULL) == 0);
+      assert (pthread_join (thread, NULL) == 0);
+      assert (strcmp (cleanup_log, "tf") == 0);
+
+      throw_error (GENERIC_ERROR, "in main");
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (strcmp (e.message, "in main") == 0);
+  assert (strcmp (cleanup_log, "tfm") == 0);
+}
+
+/* Many threads registering final cleanups at once.  */
+
+#define FINAL_THREADS 8
+#define FINAL_CLEANUPS_PER_THREAD 10000
+
+static void
+count_final_cleanup (void *arg)
+{
+  int *count = arg;
+
+  (*count)++;
+}
+
+static void *
+final_registrar_main (void *arg)
+{
+  int i;
+
+  for (i = 0; i < FINAL_CLEANUPS_PER_THREAD; i++)
+    cexcept_make_final_cleanup (count_final_cleanup, arg);
+  return NULL;
+}
+
+static void
+test_concurrent_final_cleanups (void)
+{
+  pthread_t threads[FINAL_THREADS];
+  struct cleanup *old_chain;
+  int count = 0;
+  int i;
+
+  old_chain = cexcept_make_final_cleanup (cexcept_null_cleanup, NULL);
+  for (i = 0; i < FINAL_THREADS; i++)
+    assert (pthread_create (&threads[i], NULL, final_registrar_main,
+			    &count) == 0);
+  for (i = 0; i < FINAL_THREADS; i++)
+    assert (pthread_join (threads[i], NULL) == 0);
+
+  /* No registration was lost.  */
+  cexcept_do_final_cleanups (old_chain);
+  assert (count == FINAL_THREADS * FINAL_CLEANUPS_PER_THREAD);
+
+  cexcept_do_final_cleanups (cexcept_all_cleanups ());
+}
+
+/* Threads taking and dropping references to a shared context.  */
+
+#define REF_THREADS 8
+#define REFS_PER_THREAD 100000
+
+static void *
+ref_unref_main (void *arg)
+{
+  struct cexcept_ctx *ctx = arg;
+  int i;
+
+  for (i = 0; i < REFS_PER_THREAD; i++)
+    {
+      assert (cexcept_ref (ctx) == ctx);
+      assert (cexcept_unref (ctx) != NULL);
+    }
+  return NULL;
+}
+
+static void
+test_concurrent_refs (void)
+{
+  pthread_t threads[REF_THREADS];
+  struct cexcept_ctx *ctx;
+  int i;
+
+  assert (cexcept_new (&ctx) == 0);
+
+  for (i = 0; i < REF_THREADS; i++)
+    assert (pthread_create (&threads[i], NULL, ref_unref_main, ctx) == 0);
+  for (i = 0; i < REF_THREADS; i++)
+    assert (pthread_join (threads[i], NULL) == 0);
+
+  /* No reference was lost or counted twice: the context goes with its
+     last one.  */
+  assert (cexcept_ref (ctx) == ctx);
+  assert (cexcept_unref (ctx) == ctx);
+  assert (cexcept_unref (ctx) == NULL);
+}
+
+/* Do the final cleanups above ARG, a struct cleanup *, and check that
+   this thread's counts are not changed by it.  */
+
+static void *
+final_doer_main (void *arg)
+{
+  struct cexcept_cleanup_stats before, after;
+
+  cexcept_get_cleanup_stats (&before);
+  cexcept_do_final_cleanups (arg);
+  cexcept_get_cleanup_stats (&after);
+  assert (after.count == before.count && after.bytes == before.bytes);
+  return NULL;
+}
+
+static void
+test_cleanup_stats (void)
+{
+  struct cexcept_cleanup_stats before, during, after;
+  struct cleanup *old_chain;
+  char arg[16] = "";
+
+  cexcept_reset_cleanup_peaks ();
+  cexcept_get_cleanup_stats (&before);
+  assert (before.peak_count == before.count);
+
+  old_chain = make_cleanup (cexcept_null_cleanup, NULL);
+  make_cleanup (cexcept_null_cleanup, NULL);
+  cexcept_make_cleanup_inline (cexcept_null_cleanup, arg, sizeof (arg));
+  cexcept_get_cleanup_stats (&during);
+  assert (during.count == before.count + 3);
+  assert (during.bytes > before.bytes + sizeof (arg));
+
+  do_cleanups (old_chain);
+  cexcept_get_cleanup_stats (&after);
+  assert (after.count == before.count);
+  assert (after.bytes == before.bytes);
+  assert (after.peak_count == during.count);
+  assert (after.peak_bytes == during.bytes);
+
+  /* Final cleanups are shared, and are counted by no thread, even when
+     transferred there and done by another thread.  */
+  {
+    struct cleanup *old_final;
+    pthread_t thread;
+
+    old_final = cexcept_make_final_cleanup (cexcept_null_cleanup, NULL);
+    old_chain = make_cleanup (cexcept_null_cleanup, NULL);
+    make_cleanup (cexcept_null_cleanup, NULL);
+    cexcept_transfer_cleanups_to_final (old_chain);
+    cexcept_get_cleanup_stats (&during);
+    assert (during.count == before.count && during.bytes == before.bytes);
+
+    assert (pthread_create (&thread, NULL, final_doer_main,
+			    (void *) old_final) == 0);
+    assert (pthread_join (thread, NULL) == 0);
+    cexcept_get_cleanup_stats (&after);
+    assert (after.count == before.count && after.bytes == before.bytes);
+  }
+
+#ifdef ENABLE_LEAK_CHECK
+  {
+    volatile struct cexception e;
+    char report[256];
+    FILE *log = tmpfile ();
+    int saved_stderr = dup (2);
+    size_t len;
+
+    /* A TRY block that forgets its cleanup gets it reported.  */
+    fflush (stderr);
+    dup2 (fileno (log), 2);
+    TRY_CATCH (e, RETURN_MASK_ERROR)
+      {
+	make_cleanup (cexcept_null_cleanup, NULL);
+      }
+    fflush (stderr);
+    dup2 (saved_stderr, 2);
+    close (saved_stderr);
+
+    rewind (log);
+    len = fread (report, 1, sizeof (report) - 1, log);
+    report[len] = '\0';
+    fclose (log);
+    assert (strstr (report, "1 cleanup left pending") != NULL);
+  }
+#endif
+}
+
+static void
+test_buf (void)
+{
+  volatile struct cexception e;
+  struct cexcept_cleanup_stats before, after;
+  struct alloc_counts counts;
+  struct cexcept_buf sbuf;
+  char small[8];
+  char *data;
+  size_t len;
+  int i;
+
+  cexcept_get_cleanup_stats (&before);
+  memset (&counts, 0, sizeof (counts));
+  cexcept_set_allocator (counting_alloc, counting_realloc, counting_free,
+			 &counts);
+
+  /* Small contents stay in the inline storage until released.  */
+  cexcept_buf_init (&sbuf, small, sizeof (small));
+  cexcept_buf_append (&sbuf, "abc", 3);
+  assert (sbuf.data == small);
+  data = cexcept_buf_release (&sbuf, &len);
+  assert (len == 3 && memcmp (data, "abc", 3) == 0);
+  free (data);
+  /* The cleanup, freed on release, and the copy made then.  */
+  assert (counts.allocs == 2 && counts.frees == 1);
+  cexcept_get_cleanup_stats (&after);
+  assert (after.count == before.count);
+
+  /* Growing past it reallocates geometrically.  */
+  cexcept_buf_init (&sbuf, small, sizeof (small));
+  for (i = 0; i < 1000; i++)
+    cexcept_buf_append (&sbuf, "x", 1);
+  assert (sbuf.len == 1000 && sbuf.alloc >= 1000);
+  assert (counts.reallocs <= 5);
+  data = cexcept_buf_release (&sbuf, &len);
+  assert (len == 1000 && data[999] == 'x');
+  free (data);
+
+  /* A throw frees the buffer, however it grew.  */
+  memset (&counts, 0, sizeof (counts));
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      struct cexception ex = { RETURN_ERROR, GENERIC_ERROR, "buf" };
+
+      cexcept_buf_init (&sbuf, NULL, 0);
+      memset (cexcept_buf_reserve (&sbuf, 100), 'y', 100);
+      cexcept_buf_commit (&sbuf, 100);
+      cexcept_buf_reserve (&sbuf, 1000);
+      cexcept_throw (ex);
     }
+  assert (e.reason == RETURN_ERROR);
+  assert (counts.allocs == 2);
+  assert (counts.frees == 2);
 
+  /* A size that would wrap around is refused, not truncated.  */
+  cexcept_buf_init (&sbuf, small, sizeof (small));
+  cexcept_buf_append (&sbuf, "abc", 3);
   TRY_CATCH (e, RETURN_MASK_ERROR)
     {
-      char *a;
+      cexcept_buf_reserve (&sbuf, SIZE_MAX - 1);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == -EOVERFLOW);
+  assert (sbuf.data == small && sbuf.len == 3);
+  cexcept_buf_done (&sbuf);
 
-      a = test_realloc (1);
-      free (a);
-      a = test_realloc (2);
-      free (a);
-      a = test_realloc (3);
-      free (a);
+  /* Under a newer cleanup, the buffer's stays until that one is
+     done.  */
+  {
+    struct cleanup *old_chain = make_cleanup (cexcept_null_cleanup, NULL);
+
+    cexcept_buf_init (&sbuf, small, sizeof (small));
+    make_cleanup (cexcept_null_cleanup, NULL);
+    cexcept_buf_done (&sbuf);
+    cexcept_get_cleanup_stats (&after);
+    assert (after.count == before.count + 3);
+    do_cleanups (old_chain);
+  }
+
+  /* Every buffer's cleanup is gone.  */
+  cexcept_get_cleanup_stats (&after);
+  assert (after.count == before.count);
+
+  cexcept_set_allocator (NULL, NULL, NULL, NULL);
+}
+
+static void
+test_builtin_cleanups (void)
+{
+  struct cleanup *old_chain;
+  long page_size = sysconf (_SC_PAGESIZE);
+  unsigned char vec;
+  char *pages;
+  int fds[8];
+  int i;
+
+  cleanup_log[0] = '\0';
+  make_cleanup (log_cleanup, "a");
+
+  /* Two runs of descriptors, with a function cleanup between them.  */
+  old_chain = cexcept_make_cleanup_fclose (fopen ("/dev/null", "r"));
+  for (i = 0; i < 8; i++)
+    {
+      fds[i] = open ("/dev/null", O_RDONLY);
+      assert (fds[i] >= 0);
+      cexcept_make_cleanup_close (fds[i]);
+      if (i == 3)
+	make_cleanup (log_cleanup, "b");
     }
-  if (e.reason < 0)
+
+  cexcept_make_cleanup_fclose (fopen ("/dev/null", "r"));
+  cexcept_make_cleanup_free (malloc (10));
+  cexcept_make_cleanup_free (malloc (20));
+
+  /* Three adjacent pages, unmapped in a single call.  */
+  pages = mmap (NULL, 3 * page_size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert (pages != MAP_FAILED);
+  for (i = 0; i < 3; i++)
+    cexcept_make_cleanup_munmap (pages + i * page_size, page_size);
+
+  do_cleanups (old_chain);
+
+  assert (strcmp (cleanup_log, "b") == 0);
+  for (i = 0; i < 8; i++)
+    assert (fcntl (fds[i], F_GETFD) == -1 && errno == EBADF);
+  for (i = 0; i < 3; i++)
+    assert (mincore (pages + i * page_size, page_size, &vec) == -1
+	    && errno == ENOMEM);
+
+  do_cleanups (cexcept_all_cleanups ());
+  assert (strcmp (cleanup_log, "ba") == 0);
+}
+
+/* Log the digit ARG, an int, holds when the cleanup runs.  */
+
+static void
+log_digit_cleanup (void *arg)
+{
+  char digit = '0' + *(int *) arg;
+
+  strncat (cleanup_log, &digit, 1);
+}
+
+static void
+test_undo (void)
+{
+  static int a, b;
+  static char big[200000];
+  volatile struct cexception e;
+  struct cexcept_cleanup_stats before, during;
+  struct alloc_counts counts;
+  struct cleanup *old_chain;
+  int i;
+
+  cleanup_log[0] = '\0';
+  a = 1;
+  b = 2;
+  memset (big, 'b', sizeof (big));
+  TRY_CATCH (e, RETURN_MASK_ERROR)
     {
-      fprintf (stderr, "caught: %s", e.message);
-      return EXIT_FAILURE;
+      cexcept_make_undo (&a, sizeof (a));
+      a = 3;
+      cexcept_make_undo (&b, sizeof (b));
+      b = 4;
+      /* Saved twice: the first copy wins.  */
+      cexcept_make_undo (&a, sizeof (a));
+      a = 5;
+      make_cleanup (log_digit_cleanup, &a);
+      cexcept_make_undo (&a, sizeof (a));
+      a = 6;
+      /* Larger than a chunk.  */
+      cexcept_make_undo (big, sizeof (big));
+      memset (big, 'x', sizeof (big));
+      throw_error (GENERIC_ERROR, "undo");
     }
+  assert (e.reason == RETURN_ERROR);
+  /* The cleanup between the runs saw only the newer run undone.  */
+  assert (strcmp (cleanup_log, "5") == 0);
+  assert (a == 1 && b == 2);
+  assert (big[0] == 'b' && big[sizeof (big) - 1] == 'b');
+
+  /* A long run is a single cleanup, discarded at once.  */
+  cexcept_get_cleanup_stats (&before);
+  old_chain = cexcept_make_undo (&a, sizeof (a));
+  for (i = 0; i < 100000; i++)
+    assert (cexcept_make_undo (&b, sizeof (b)) == old_chain);
+  a = 7;
+  b = 8;
+  cexcept_get_cleanup_stats (&during);
+  assert (during.count == before.count + 1);
+  discard_cleanups (old_chain);
+  assert (a == 7 && b == 8);
+
+  /* Once the arena has a chunk, a run only allocates its cleanup.  */
+  memset (&counts, 0, sizeof (counts));
+  cexcept_set_allocator (counting_alloc, counting_realloc, counting_free,
+			 &counts);
+  old_chain = cexcept_make_undo (&a, sizeof (a));
+  cexcept_make_undo (&b, sizeof (b));
+  a = 9;
+  b = 9;
+  do_cleanups (old_chain);
+  assert (a == 7 && b == 8);
+  assert (counts.allocs == 1 && counts.frees == 1);
+  cexcept_set_allocator (NULL, NULL, NULL, NULL);
+}
+
+static pthread_mutex_t test_mutexes[CEXCEPT_LOCKS_MAX + 1];
+
+/* Return non-zero if test_mutexes[I] is locked.  */
+
+static int
+test_mutex_locked (int i)
+{
+  if (pthread_mutex_trylock (&test_mutexes[i]) != 0)
+    return 1;
+  pthread_mutex_unlock (&test_mutexes[i]);
+  return 0;
+}
+
+/* A cleanup checking that the lock ARG, an int, is still held.  */
+
+static void
+check_locked_cleanup (void *arg)
+{
+  assert (test_mutex_locked (*(int *) arg));
+  strcat (cleanup_log, "c");
+}
+
+static volatile int lock_waiter_ready;
+
+/* Wait for test_mutexes[0], held by the main thread, with accounting
+   on, and store this thread's lock statistics in ARG.  */
+
+static void *
+lock_waiter_main (void *arg)
+{
+  __atomic_store_n (&lock_waiter_ready, 1, __ATOMIC_RELEASE);
+  cexcept_lock (&test_mutexes[0]);
+  cexcept_unlock (&test_mutexes[0]);
+  cexcept_get_lock_stats (arg);
+  return NULL;
+}
+
+/* Lock ARG, a robust mutex, and exit without unlocking it.  */
+
+static void *
+lock_and_exit_main (void *arg)
+{
+  pthread_mutex_lock (arg);
+  return NULL;
+}
+
+static void
+test_locks (void)
+{
+  static int zero = 0;
+  volatile struct cexception e;
+  struct cexcept_lock_stats stats;
+  pthread_t thread;
+  int i;
+
+  for (i = 0; i <= CEXCEPT_LOCKS_MAX; i++)
+    pthread_mutex_init (&test_mutexes[i], NULL);
+  cleanup_log[0] = '\0';
+  cexcept_reset_lock_stats ();
+
+  /* Locks are released after the cleanups of their own block, and
+     only those of the blocks the exception leaves.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      volatile struct cexception inner;
+
+      cexcept_lock (&test_mutexes[0]);
+      make_cleanup (check_locked_cleanup, &zero);
+      TRY_CATCH (inner, RETURN_MASK_ERROR)
+	{
+	  cexcept_lock (&test_mutexes[1]);
+	  cexcept_lock (&test_mutexes[2]);
+	  throw_error (GENERIC_ERROR, "inner");
+	}
+      assert (inner.reason == RETURN_ERROR);
+      assert (test_mutex_locked (0));
+      assert (!test_mutex_locked (1) && !test_mutex_locked (2));
+
+      /* Crossing a catcher that does not handle the exception.  */
+      TRY_CATCH (inner, RETURN_MASK_QUIT)
+	{
+	  cexcept_lock (&test_mutexes[1]);
+	  throw_error (GENERIC_ERROR, "outer");
+	}
+      assert (0);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (strcmp (e.message, "outer") == 0);
+  assert (strcmp (cleanup_log, "c") == 0);
+  for (i = 0; i < 3; i++)
+    assert (!test_mutex_locked (i));
+
+  /* A lock kept past a normal exit belongs to the enclosing code, and
+     locks may be released out of order.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_lock (&test_mutexes[0]);
+      cexcept_lock (&test_mutexes[1]);
+    }
+  assert (e.reason == 0);
+  assert (test_mutex_locked (0) && test_mutex_locked (1));
+  cexcept_unlock (&test_mutexes[0]);
+  assert (!test_mutex_locked (0) && test_mutex_locked (1));
+  cexcept_unlock (&test_mutexes[1]);
+  assert (!test_mutex_locked (1));
+
+  /* One lock too many is refused, and the others released.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      for (i = 0; i <= CEXCEPT_LOCKS_MAX; i++)
+	cexcept_lock (&test_mutexes[i]);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == -ENOLCK);
+  for (i = 0; i <= CEXCEPT_LOCKS_MAX; i++)
+    assert (!test_mutex_locked (i));
+
+  cexcept_get_lock_stats (&stats);
+  assert (stats.acquired == 6 + CEXCEPT_LOCKS_MAX);
+  assert (stats.unwound == 4 + CEXCEPT_LOCKS_MAX);
+  assert (stats.contended == 0 && stats.hold_ns == 0);
+
+  /* A lock of an enclosing block released in an inner one does not
+     keep the inner block's locks from being released.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      volatile struct cexception inner;
+
+      cexcept_lock (&test_mutexes[0]);
+      TRY_CATCH (inner, RETURN_MASK_ERROR)
+	{
+	  cexcept_lock (&test_mutexes[1]);
+	  cexcept_unlock (&test_mutexes[0]);
+	  throw_error (GENERIC_ERROR, "inner");
+	}
+      assert (inner.reason == RETURN_ERROR);
+      assert (!test_mutex_locked (0) && !test_mutex_locked (1));
+
+      cexcept_lock (&test_mutexes[2]);
+      throw_error (GENERIC_ERROR, "outer");
+    }
+  assert (e.reason == RETURN_ERROR);
+  for (i = 0; i < 3; i++)
+    assert (!test_mutex_locked (i));
+
+  /* The same, left normally: the released lock's entry goes away with
+     the next unlock in the outer code.  */
+  cexcept_lock (&test_mutexes[0]);
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_lock (&test_mutexes[1]);
+      cexcept_unlock (&test_mutexes[0]);
+      cexcept_unlock (&test_mutexes[1]);
+    }
+  cexcept_lock (&test_mutexes[2]);
+  cexcept_unlock (&test_mutexes[2]);
+  for (i = 0; i < CEXCEPT_LOCKS_MAX; i++)
+    cexcept_lock (&test_mutexes[i]);
+  for (i = 0; i < CEXCEPT_LOCKS_MAX; i++)
+    cexcept_unlock (&test_mutexes[i]);
+
+  /* Hold times, with accounting on.  */
+  assert (cexcept_set_lock_accounting (1) == 0);
+  cexcept_reset_lock_stats ();
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_lock (&test_mutexes[0]);
+      usleep (2000);
+      throw_error (GENERIC_ERROR, "held");
+    }
+  cexcept_get_lock_stats (&stats);
+  assert (stats.acquired == 1 && stats.unwound == 1);
+  assert (stats.hold_ns >= 2000000);
+  assert (stats.unwound_hold_ns == stats.hold_ns);
+  assert (stats.max_hold_ns == stats.hold_ns);
+
+  /* Contention, seen by a thread waiting for a lock held here.  */
+  pthread_mutex_lock (&test_mutexes[0]);
+  assert (pthread_create (&thread, NULL, lock_waiter_main, &stats) == 0);
+  while (!__atomic_load_n (&lock_waiter_ready, __ATOMIC_ACQUIRE))
+    ;
+  usleep (50000);
+  pthread_mutex_unlock (&test_mutexes[0]);
+  assert (pthread_join (thread, NULL) == 0);
+  assert (stats.acquired == 1 && stats.contended == 1);
+  assert (stats.wait_ns > 0 && stats.unwound == 0);
+  assert (cexcept_set_lock_accounting (0) == 1);
+
+  for (i = 0; i <= CEXCEPT_LOCKS_MAX; i++)
+    pthread_mutex_destroy (&test_mutexes[i]);
+
+  /* A robust mutex whose owner died is handed over for repair.  */
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutex_t robust;
+
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init (&robust, &attr);
+    pthread_mutexattr_destroy (&attr);
+
+    assert (pthread_create (&thread, NULL, lock_and_exit_main, &robust)
+	    == 0);
+    assert (pthread_join (thread, NULL) == 0);
+    assert (cexcept_lock (&robust) == EOWNERDEAD);
+    assert (pthread_mutex_consistent (&robust) == 0);
+    cexcept_unlock (&robust);
+    assert (cexcept_lock (&robust) == 0);
+    cexcept_unlock (&robust);
+
+    /* Left unrepaired by an exception, it cannot be used again.  */
+    assert (pthread_create (&thread, NULL, lock_and_exit_main, &robust)
+	    == 0);
+    assert (pthread_join (thread, NULL) == 0);
+    TRY_CATCH (e, RETURN_MASK_ERROR)
+      {
+	assert (cexcept_lock (&robust) == EOWNERDEAD);
+	throw_error (GENERIC_ERROR, "not repaired");
+      }
+    assert (e.reason == RETURN_ERROR);
+    assert (pthread_mutex_lock (&robust) == ENOTRECOVERABLE);
+    pthread_mutex_destroy (&robust);
+  }
+}
+
+/* Return the sum of the LEN bytes at DATA, reading them one by one.  */
+
+static unsigned int
+sum_bytes (const volatile unsigned char *data, size_t len)
+{
+  unsigned int sum = 0;
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    sum += data[i];
+  return sum;
+}
+
+/* Read the LEN bytes at DATA, a struct mapped_region *.  */
+
+struct mapped_region
+{
+  const unsigned char *data;
+  size_t len;
+};
+
+static void *
+sum_mapped_main (void *arg)
+{
+  struct mapped_region *region = arg;
+
+  sum_bytes (region->data, region->len);
+  return NULL;
+}
+
+/* In a child process, map PATH, a file of two pages, truncate it, and
+   read the mapping past its end, from another thread if OTHER_THREAD,
+   or outside any TRY block otherwise.  Check that SIGBUS kills the
+   child rather than being thrown.  */
+
+static void
+check_map_file_sigbus (const char *path, int other_thread)
+{
+  pid_t pid = fork ();
+  int status;
+
+  assert (pid >= 0);
+  if (pid == 0)
+    {
+      volatile struct cexception e;
+      struct mapped_region region;
+      size_t len;
+
+      region.data = cexcept_map_file (path, &len);
+      region.len = len;
+      assert (truncate (path, 1) == 0);
+      if (!other_thread)
+	sum_bytes (region.data, region.len);
+      TRY_CATCH (e, RETURN_MASK_ALL)
+	{
+	  pthread_t thread;
+
+	  pthread_create (&thread, NULL, sum_mapped_main, &region);
+	  pthread_join (thread, NULL);
+	}
+      _exit (0);
+    }
+  assert (waitpid (pid, &status, 0) == pid);
+  assert (WIFSIGNALED (status) && WTERMSIG (status) == SIGBUS);
+}
+
+static void
+test_map_file (void)
+{
+  volatile struct cexception e;
+  char path[] = "/tmp/test-libcexcept.XXXXXX";
+  size_t page_size = sysconf (_SC_PAGESIZE);
+  const unsigned char *volatile data = NULL;
+  volatile size_t len = 0;
+  unsigned char vec;
+  struct cleanup *old_chain;
+  size_t mapped_len;
+  char *contents;
+  int fd;
+
+  fd = mkstemp (path);
+  assert (fd >= 0);
+
+  /* An empty file is not mapped.  */
+  old_chain = cexcept_all_cleanups ();
+  assert (cexcept_map_file (path, &mapped_len) == NULL);
+  assert (mapped_len == 0);
+  assert (cexcept_all_cleanups () == old_chain);
+
+  contents = malloc (2 * page_size);
+  memset (contents, 1, 2 * page_size);
+  assert (write (fd, contents, 2 * page_size) == (ssize_t) (2 * page_size));
+  free (contents);
+
+  /* The contents are mapped until the cleanups are done.  */
+  data = cexcept_map_file (path, &mapped_len);
+  assert (mapped_len == 2 * page_size);
+  assert (sum_bytes (data, mapped_len) == 2 * page_size);
+  do_cleanups (old_chain);
+  assert (mincore ((void *) data, page_size, &vec) == -1 && errno == ENOMEM);
+
+  /* Reading past the end of a file truncated under the mapping throws
+     an error, and unwinding unmaps it.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      size_t n;
+
+      data = cexcept_map_file (path, &n);
+      len = n;
+      assert (ftruncate (fd, page_size / 2) == 0);
+      sum_bytes (data, len);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == -EIO);
+  assert (mincore ((void *) data, page_size, &vec) == -1 && errno == ENOMEM);
+
+  /* Other threads, and code outside any TRY block, get the signal.  */
+  contents = calloc (2, page_size);
+  assert (pwrite (fd, contents, 2 * page_size, 0)
+	  == (ssize_t) (2 * page_size));
+  check_map_file_sigbus (path, 1);
+  assert (pwrite (fd, contents, 2 * page_size, 0)
+	  == (ssize_t) (2 * page_size));
+  check_map_file_sigbus (path, 0);
+  free (contents);
+
+  close (fd);
+  unlink (path);
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_map_file (path, &mapped_len);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == -ENOENT);
+  assert (strstr (e.message, path) != NULL);
+}
+
+/* Run cexcept-dump on the recorder file PATH written by test_recorder,
+   and check what it prints.  Then check that it rejects the file once
+   its header claims no rings.  */
+
+static void
+check_recorder_dump (const char *path)
+{
+  char command[256], line[256];
+  struct recorder_header header;
+  FILE *pipe, *file;
+  int i = 1;
+
+  snprintf (command, sizeof (command), "%s %s", CEXCEPT_DUMP, path);
+  pipe = popen (command, "r");
+  assert (pipe != NULL);
+  assert (fgets (line, sizeof (line), pipe) != NULL);
+  assert (strstr (line, "1 of 2 threads recorded, 4 records each") != NULL);
+  while (fgets (line, sizeof (line), pipe) != NULL)
+    {
+      char expected[64];
+
+      snprintf (expected, sizeof (expected), " depth 1 error %d pc ",
+		NOT_FOUND_ERROR);
+      assert (strstr (line, expected) != NULL);
+      snprintf (expected, sizeof (expected), ": recorded %d\n", i++);
+      assert (strstr (line, expected) != NULL);
+    }
+  assert (i == 5);
+  assert (pclose (pipe) == 0);
+
+  file = fopen (path, "r+b");
+  assert (file != NULL);
+  assert (fread (&header, sizeof (header), 1, file) == 1);
+  header.nrings = 0;
+  rewind (file);
+  assert (fwrite (&header, sizeof (header), 1, file) == 1);
+  fclose (file);
+
+  snprintf (command, sizeof (command), "%s %s 2>/dev/null",
+	    CEXCEPT_DUMP, path);
+  pipe = popen (command, "r");
+  assert (pipe != NULL);
+  assert (fgets (line, sizeof (line), pipe) == NULL);
+  i = pclose (pipe);
+  assert (WIFEXITED (i) && WEXITSTATUS (i) == EXIT_FAILURE);
+}
+
+static void
+test_recorder (void)
+{
+  volatile struct cexception e;
+  char path[] = "/tmp/test-libcexcept.XXXXXX";
+  struct recorder_header header;
+  struct recorder_ring ring;
+  struct recorder_record record;
+  FILE *file;
+  int fd, i;
+
+  fd = mkstemp (path);
+  assert (fd >= 0);
+  close (fd);
+
+  /* A file too large for the address space, or for an off_t, is
+     refused before anything is written.  */
+  assert (cexcept_recorder_open (path, 1U << 24, ~0U) == -EINVAL);
+
+  assert (cexcept_recorder_open (path, 3, 2) == 0);
+  for (i = 0; i < 5; i++)
+    {
+      TRY_CATCH (e, RETURN_MASK_ERROR)
+	{
+	  throw_error (NOT_FOUND_ERROR, "recorded %d", i);
+	}
+    }
+  cexcept_recorder_close ();
+
+  /* Four records per ring; the last four throws are kept.  */
+  file = fopen (path, "rb");
+  assert (file != NULL);
+  assert (fread (&header, sizeof (header), 1, file) == 1);
+  assert (memcmp (header.magic, RECORDER_MAGIC, 8) == 0);
+  assert (header.ring_records == 4 && header.nrings == 2);
+  assert (header.rings_used == 1);
+  assert (fread (&ring, sizeof (ring), 1, file) == 1);
+  assert (ring.head == 5);
+
+  /* Slot 0 holds the fifth record, after the second ring header.  */
+  fseek (file, sizeof (header) + 2 * sizeof (ring), SEEK_SET);
+  assert (fread (&record, sizeof (record), 1, file) == 1);
+  assert (record.seq == 5);
+  assert (record.reason == RETURN_ERROR);
+  assert (record.error == NOT_FOUND_ERROR);
+  assert (record.depth == 1);
+  assert (strcmp (record.message, "recorded 4") == 0);
+  fclose (file);
+
+  check_recorder_dump (path);
+
+  unlink (path);
+}
+
+static int
+xml_error_p (const struct cexception *exception, void *data)
+{
+  return exception->error == XML_PARSE_ERROR;
+}
+
+/* Throw ERROR from within a catcher that only handles NOT_FOUND_ERROR
+   and XML_PARSE_ERROR, and return what it caught, or -1 if it was
+   skipped.  */
+
+static int
+filtered_catch (int error)
+{
+  static const struct cexcept_filter filter
+    = { CEXCEPT_ERROR_BIT (NOT_FOUND_ERROR), xml_error_p, NULL };
+  volatile struct cexception e;
+  volatile int caught = -1;
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      CEXCEPT_TRY_FILTER (e, RETURN_MASK_ERROR, &filter)
+	{
+	  make_cleanup (log_cleanup, "i");
+	  throw_error (error, "filtered");
+	}
+      caught = e.error;
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == error);
+
+  return caught;
+}
+
+static void
+test_filter (void)
+{
+  cleanup_log[0] = '\0';
+  assert (filtered_catch (NOT_FOUND_ERROR) == NOT_FOUND_ERROR);
+  assert (filtered_catch (XML_PARSE_ERROR) == XML_PARSE_ERROR);
+  assert (filtered_catch (GENERIC_ERROR) == -1);
+  assert (strcmp (cleanup_log, "iii") == 0);
+}
+
+static void
+test_retain (void)
+{
+  volatile struct cexception e;
+  struct cexception saved;
+  struct alloc_counts counts;
+  const char *text;
+
+  memset (&counts, 0, sizeof (counts));
+  cexcept_set_allocator (counting_alloc, counting_realloc, counting_free,
+			 &counts);
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      throw_error (GENERIC_ERROR, "kept %d", 1);
+    }
+  saved = e;
+  cexcept_exception_retain (&saved);
+
+  /* The next throw from the same depth does not free the message.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      throw_error (GENERIC_ERROR, "other");
+    }
+  assert (strcmp (saved.message, "kept 1") == 0);
+
+  /* A rethrow passes the same message along, without formatting it
+     again.  */
+  text = saved.message;
+  counts.allocs = 0;
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      TRY_CATCH (e, RETURN_MASK_ERROR)
+	{
+	  cexcept_rethrow (saved);
+	}
+      assert (e.message == text);
+      cexcept_rethrow (e);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == GENERIC_ERROR);
+  assert (e.message == text);
+  /* Nothing was allocated: the catchers are recycled.  */
+  assert (counts.allocs == 0);
+
+  cexcept_exception_release (&saved);
+  assert (strcmp (e.message, "kept 1") == 0);
+
+  cexcept_set_allocator (NULL, NULL, NULL, NULL);
+}
+
+/* A message catalog, and a translation of it.  */
+
+#define TEST_MESSAGES(M)						\
+  M (MSG_NOT_FOUND, "%s: not found")					\
+  M (MSG_MIXED, "%d%% of %5.2f, %*d, %.3s, %zu, %lld, %c")		\
+  M (MSG_UNSUPPORTED, "%d then %n")
+
+enum test_message { CEXCEPT_CATALOG_IDS (TEST_MESSAGES) };
+static CEXCEPT_CATALOG_DEFINE (test_catalog, TEST_MESSAGES);
+
+static const char *const translated_formats[] =
+  { "%s : introuvable" };
+static const struct cexcept_catalog translated_catalog =
+  { 1, translated_formats };
+
+static void
+test_message_catalog (void)
+{
+  volatile struct cexception e;
+  struct cexception saved;
+  struct alloc_counts counts;
+  char name[16];
+
+  assert (cexcept_set_message_catalog (&test_catalog) == NULL);
+
+  /* The string argument is copied when thrown.  */
+  strcpy (name, "foo");
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (NOT_FOUND_ERROR, MSG_NOT_FOUND, name);
+    }
+  strcpy (name, "bar");
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == NOT_FOUND_ERROR);
+  assert (e.message == NULL);
+  assert (strcmp (cexcept_exception_message (&e), "foo: not found") == 0);
+  /* Rendered once.  */
+  assert (cexcept_exception_message (&e) == cexcept_exception_message (&e));
+
+  /* Throwing again from the same depth reuses the message, and renders
+     nothing until asked.  */
+  memset (&counts, 0, sizeof (counts));
+  cexcept_set_allocator (counting_alloc, counting_realloc, counting_free,
+			 &counts);
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (NOT_FOUND_ERROR, MSG_NOT_FOUND, name);
+    }
+  assert (counts.allocs == 0 && counts.reallocs == 0);
+  /* The text rendered for the previous throw, allocated before the
+     counting started.  */
+  assert (counts.frees == 1);
+  assert (strcmp (cexcept_exception_message (&e), "bar: not found") == 0);
+  assert (counts.allocs == 1);
+  cexcept_set_allocator (NULL, NULL, NULL, NULL);
+
+  /* The text of the message being reused, passed as an argument of the
+     next throw from the same depth.  */
+  saved = e;
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (NOT_FOUND_ERROR, MSG_NOT_FOUND,
+			 cexcept_exception_message (&saved));
+    }
+  assert (e.message_ref == saved.message_ref);
+  assert (strcmp (cexcept_exception_message (&e),
+		  "bar: not found: not found") == 0);
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (GENERIC_ERROR, MSG_MIXED, 50, 2.5, 4, 7, "abcdef",
+			 (size_t) 12, 1LL << 40, 'x');
+    }
+  assert (strcmp (cexcept_exception_message (&e),
+		  "50% of  2.50,    7, abc, 12, 1099511627776, x") == 0);
+
+  /* Rendering stops at an unsupported conversion.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (GENERIC_ERROR, MSG_UNSUPPORTED, 3);
+    }
+  assert (strcmp (cexcept_exception_message (&e), "3 then %n") == 0);
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (GENERIC_ERROR, 42);
+    }
+  assert (strcmp (cexcept_exception_message (&e), "unknown message 42") == 0);
+
+  /* A retained message is not reused by the next throw, and outlives
+     its catalog being replaced.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (NOT_FOUND_ERROR, MSG_NOT_FOUND, "kept");
+    }
+  saved = e;
+  cexcept_exception_retain (&saved);
+  assert (cexcept_set_message_catalog (&translated_catalog) == &test_catalog);
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      cexcept_throw_msg (NOT_FOUND_ERROR, MSG_NOT_FOUND, "baz");
+    }
+  assert (strcmp (cexcept_exception_message (&e), "baz : introuvable") == 0);
+  assert (strcmp (cexcept_exception_message (&saved), "kept: not found")
+	  == 0);
+  cexcept_exception_release (&saved);
+
+  /* Other exceptions have their message as is.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      throw_error (GENERIC_ERROR, "plain %d", 1);
+    }
+  assert (cexcept_exception_message (&e) == e.message);
+
+  cexcept_set_message_catalog (NULL);
+}
+
+/* Run a TRY block that makes a cleanup and throws QUIT if THROW, with
+   a finally block that logs, catches an error of its own, and
+   counts.  */
+
+static int finally_count;
+
+static void
+finally_body (int throw)
+{
+  volatile struct cexception e, inner;
+
+  CEXCEPT_TRY_FINALLY (e)
+    {
+      make_cleanup (log_cleanup, "c");
+      if (throw)
+	throw_error (GENERIC_ERROR, "from the body");
+      do_cleanups (cexcept_all_cleanups ());
+    }
+  CEXCEPT_FINALLY (e)
+    {
+      strcat (cleanup_log, "f");
+      TRY_CATCH (inner, RETURN_MASK_ERROR)
+	{
+	  throw_error (GENERIC_ERROR, "from the finally block");
+	}
+      finally_count++;
+    }
+  strcat (cleanup_log, "r");
+}
+
+static void
+test_finally (void)
+{
+  volatile struct cexception e;
+  struct alloc_counts counts;
+
+  /* On normal exit, the block runs and execution goes on.  */
+  cleanup_log[0] = '\0';
+  finally_count = 0;
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      finally_body (0);
+    }
+  assert (e.reason == 0);
+  assert (strcmp (cleanup_log, "cfr") == 0);
+  assert (finally_count == 1);
+
+  /* On an exception, the block runs after the cleanups, and the
+     exception goes on, with its message intact.  */
+  cleanup_log[0] = '\0';
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      finally_body (1);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == GENERIC_ERROR);
+  assert (strcmp (e.message, "from the body") == 0);
+  assert (strcmp (cleanup_log, "cf") == 0);
+  assert (finally_count == 2);
+
+  /* Neither path allocates.  */
+  memset (&counts, 0, sizeof (counts));
+  cexcept_set_allocator (counting_alloc, counting_realloc, counting_free,
+			 &counts);
+  TRY_CATCH (e, RETURN_MASK_ALL)
+    {
+      volatile struct cexception f;
+
+      CEXCEPT_TRY_FINALLY (f)
+	{
+	}
+      CEXCEPT_FINALLY (f)
+	{
+	  finally_count++;
+	}
+      CEXCEPT_TRY_FINALLY (f)
+	{
+	  struct cexception quit = { RETURN_QUIT, CEXCEPT_NO_ERROR,
+				     "quit", NULL };
+
+	  cexcept_throw (quit);
+	}
+      CEXCEPT_FINALLY (f)
+	{
+	  finally_count++;
+	}
+    }
+  assert (e.reason == RETURN_QUIT);
+  assert (finally_count == 4);
+  assert (counts.allocs == 0 && counts.reallocs == 0 && counts.frees == 0);
+  cexcept_set_allocator (NULL, NULL, NULL, NULL);
+
+  /* A "break" ends the block, but does not swallow the exception.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      volatile struct cexception f;
+
+      CEXCEPT_TRY_FINALLY (f)
+	{
+	  throw_error (GENERIC_ERROR, "through a break");
+	}
+      CEXCEPT_FINALLY (f)
+	{
+	  finally_count++;
+	  break;
+	  finally_count++;
+	}
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (strcmp (e.message, "through a break") == 0);
+  assert (finally_count == 5);
+
+  /* After a TRY that does not catch everything, the finally block
+     refuses to run.  */
+  {
+    pid_t pid = fork ();
+    int status;
+
+    assert (pid >= 0);
+    if (pid == 0)
+      {
+	volatile struct cexception f;
+
+	dup2 (open ("/dev/null", O_WRONLY), 2);
+	CEXCEPT_TRY (f, RETURN_MASK_QUIT)
+	  {
+	  }
+	CEXCEPT_FINALLY (f)
+	  {
+	  }
+	_exit (0);
+      }
+    assert (waitpid (pid, &status, 0) == pid);
+    assert (WIFSIGNALED (status) && WTERMSIG (status) == SIGABRT);
+  }
+}
+
+/* Enter region "test-region" COUNT times, throwing an error out of
+   it if THROW.  */
+
+static void
+enter_test_region (int count, int throw)
+{
+  volatile struct cexception e;
+  int i;
+
+  for (i = 0; i < count; i++)
+    {
+      CEXCEPT_TRY_NAMED (e, RETURN_MASK_ERROR, "test-region")
+	{
+	  if (throw)
+	    throw_error (GENERIC_ERROR, "region");
+	}
+    }
+}
+
+static void *
+region_thread_main (void *arg)
+{
+  enter_test_region (7, 0);
+  return NULL;
+}
+
+/* Names for more regions than a snapshot holds, entered one each by
+   two threads.  */
+
+#define MANY_REGIONS 80
+
+static char many_region_names[MANY_REGIONS][16];
+
+static void *
+many_regions_main (void *arg)
+{
+  volatile struct cexception e;
+  int i;
+
+  for (i = (intptr_t) arg; i < MANY_REGIONS; i += 2)
+    {
+      CEXCEPT_TRY_NAMED (e, RETURN_MASK_ERROR, many_region_names[i])
+	{
+	}
+    }
+  return NULL;
+}
+
+/* Return the stats of "test-region" in a snapshot, and the snapshot
+   in *SNAPSHOT.  */
+
+static const struct cexcept_region_stats *
+find_test_region (struct cexcept_region_stats **snapshot)
+{
+  size_t n, i;
+
+  *snapshot = cexcept_region_snapshot (&n, NULL);
+  for (i = 0; i < n; i++)
+    if (strcmp ((*snapshot)[i].name, "test-region") == 0)
+      return &(*snapshot)[i];
+  return NULL;
+}
+
+static void
+test_regions (void)
+{
+  const struct cexcept_region_stats *stats;
+  const struct cexcept_region_histogram *normal, *exception;
+  struct cexcept_region_stats *snapshot;
+  volatile struct cexception e;
+  unsigned long sum;
+  pthread_t thread;
+  int i;
+
+  /* Nothing is recorded while recording is off.  */
+  enter_test_region (5, 0);
+  assert (find_test_region (&snapshot) == NULL);
+  cexcept_region_snapshot_free (snapshot);
+
+  assert (cexcept_set_region_recording (1) == 0);
+
+  enter_test_region (100, 0);
+  enter_test_region (10, 1);
+  /* An exception the region does not catch counts too.  */
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      CEXCEPT_TRY_NAMED (e, RETURN_MASK_QUIT, "test-region")
+	{
+	  throw_error (GENERIC_ERROR, "through the region");
+	}
+    }
+  assert (e.reason == RETURN_ERROR);
+
+  /* As does another thread's, after it exited.  */
+  assert (pthread_create (&thread, NULL, region_thread_main, NULL) == 0);
+  assert (pthread_join (thread, NULL) == 0);
+
+  assert (cexcept_set_region_recording (0) == 1);
+  enter_test_region (5, 0);
+
+  stats = find_test_region (&snapshot);
+  assert (stats != NULL);
+  normal = &stats->exits[CEXCEPT_REGION_NORMAL];
+  exception = &stats->exits[CEXCEPT_REGION_EXCEPTION];
+  assert (normal->count == 107);
+  assert (exception->count == 11);
+
+  for (sum = 0, i = 0; i < CEXCEPT_REGION_BUCKETS; i++)
+    sum += normal->buckets[i];
+  assert (sum == normal->count);
+  assert (cexcept_region_percentile (normal, 50)
+	  <= cexcept_region_percentile (normal, 99));
+  assert (cexcept_region_percentile (normal, 100) == normal->max_ns);
+  assert (normal->total_ns <= normal->max_ns * normal->count);
+  cexcept_region_snapshot_free (snapshot);
+
+  /* The exits of the regions a snapshot has no room for are counted
+     as dropped.  */
+  for (i = 0; i < MANY_REGIONS; i++)
+    snprintf (many_region_names[i], sizeof (many_region_names[i]),
+	      "region-%d", i);
+  assert (cexcept_set_region_recording (1) == 0);
+  for (i = 0; i < 2; i++)
+    {
+      assert (pthread_create (&thread, NULL, many_regions_main,
+			      (void *) (intptr_t) i) == 0);
+      assert (pthread_join (thread, NULL) == 0);
+    }
+  assert (cexcept_set_region_recording (0) == 1);
+  {
+    unsigned long dropped;
+    size_t n, j;
+
+    snapshot = cexcept_region_snapshot (&n, &dropped);
+    for (sum = 0, j = 0; j < n; j++)
+      if (strncmp (snapshot[j].name, "region-", 7) == 0)
+	sum += snapshot[j].exits[CEXCEPT_REGION_NORMAL].count;
+    assert (dropped > 0);
+    assert (sum + dropped == MANY_REGIONS);
+    cexcept_region_snapshot_free (snapshot);
+  }
+}
+
+/* Nest DEPTH catchers that only handle quits, each protecting a
+   cleanup that logs its depth, then throw an error from the
+   innermost.  */
+
+static int nested_quit_catchers_returned;
+
+static void
+nested_quit_catchers (int depth)
+{
+  static const char digits[] = "0123456789";
+  volatile struct cexception e;
+
+  if (depth == 0)
+    throw_error (GENERIC_ERROR, "deep");
+
+  TRY_CATCH (e, RETURN_MASK_QUIT)
+    {
+      make_cleanup (log_cleanup, (void *) &digits[depth]);
+      nested_quit_catchers (depth - 1);
+    }
+  /* Not reached: the error goes straight to the outer catcher.  */
+  nested_quit_catchers_returned = 1;
+}
+
+static void
+test_direct_dispatch (void)
+{
+  volatile struct cexception e;
+
+  cleanup_log[0] = '\0';
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      make_cleanup (log_cleanup, "o");
+      nested_quit_catchers (9);
+    }
+  assert (e.reason == RETURN_ERROR);
+  assert (e.error == GENERIC_ERROR);
+  assert (strcmp (e.message, "deep") == 0);
+  assert (strcmp (cleanup_log, "123456789o") == 0);
+  assert (!nested_quit_catchers_returned);
+}
+
+int
+main (int argc, char *argv[])
+{
+  volatile struct cexception e;
+  struct cleanup *old_chain;
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      test_fclose ();
+    }
+  if (e.reason < 0)
+    {
+      fprintf (stderr, "caught: %s", e.message);
+    }
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      char *a;
+
+      a = malloc (10);
+      old_chain = make_cleanup (free, a);
+
+      discard_cleanups (old_chain);
+
+      free (a);
+    }
+  if (e.reason < 0)
+    {
+      fprintf (stderr, "caught: %s", e.message);
+      return EXIT_SUCCESS;
+    }
+
+  TRY_CATCH (e, RETURN_MASK_ERROR)
+    {
+      char *a;
+
+      a = test_realloc (1);
+      free (a);
+      a = test_realloc (2);
+      free (a);
+      a = test_realloc (3);
+      free (a);
+    }
+  if (e.reason < 0)
+    {
+      fprintf (stderr, "caught: %s", e.message);
+      return EXIT_FAILURE;
+    }
+
+  test_allocator ();
+  test_profile ();
+  test_transfer ();
+  test_cancel ();
+  test_inline_cleanup ();
+  test_buf ();
+  test_deferred_cleanup ();
+  test_cleanup_stats ();
+  test_thread_final_cleanup ();
+  test_concurrent_final_cleanups ();
+  test_concurrent_refs ();
+  test_builtin_cleanups ();
+  test_undo ();
+  test_locks ();
+  test_map_file ();
+  test_recorder ();
+  test_filter ();
+  test_direct_dispatch ();
+  test_retain ();
+  test_message_catalog ();
+  test_finally ();
+  test_regions ();
 
   return EXIT_SUCCESS;
 }
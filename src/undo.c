@@ -0,0 +1,194 @@
+/* Undo journal for GNU cexcept.
+
+   Copyright (C) 2012-2013 Free Software Foundation, Inc.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  */
+
+/* The bytes saved by make_undo are copied into undo records, which are
+   carved out of a per-thread arena of chunks.  A run of make_undo calls
+   shares one cleanup, whose argument is a struct cexcept_undo: the
+   newest record of the run, each record pointing at the one before,
+   and the position the arena was at when the run started.
+
+   Doing the cleanup copies the records back, newest first, so that
+   bytes saved twice end up as they were the first time.  Doing or
+   discarding it then releases the arena back to that position, which
+   frees nothing but the chunks used since.  Cleanups are done and
+   discarded newest first, so the arena is only ever released from the
+   top, like a stack.  */
+
+#include "config.h"
+
+#include "cleanups.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "libcexcept-private.h"
+
+/* The usual size of a chunk.  Larger records get a chunk of their
+   own.  */
+#define UNDO_CHUNK_SIZE 65536
+
+union undo_align
+{
+  void *p;
+  long long ll;
+  long double ld;
+};
+
+#define UNDO_ALIGN(SIZE) \
+  (((SIZE) + sizeof (union undo_align) - 1) \
+   & ~(sizeof (union undo_align) - 1))
+
+struct undo_chunk
+{
+  /* The chunk in use before this one.  */
+  struct undo_chunk *prev;
+  size_t size;
+  union undo_align data[];
+};
+
+struct cexcept_undo_record
+{
+  /* The record made before this one in the same run, or NULL.  */
+  struct cexcept_undo_record *prev;
+  void *ptr;
+  size_t size;
+  union undo_align bytes[];
+};
+
+/* The chunk records are carved from, and how many bytes of it are
+   used.  */
+static CEXCEPT_THREAD struct undo_chunk *undo_chunk;
+static CEXCEPT_THREAD size_t undo_used;
+
+/* A chunk of the usual size kept for reuse when the arena is released
+   below it, so that a thread doing one transaction after another does
+   not allocate.  */
+static CEXCEPT_THREAD struct undo_chunk *undo_spare;
+
+/* Non-zero once the thread has a cleanup freeing its spare chunk.  */
+static CEXCEPT_THREAD int undo_spare_cleanup;
+
+/* Free the spare chunk when the thread exits.  */
+
+static void
+undo_thread_exit (void *arg)
+{
+  cexcept_xfree (undo_spare);
+  undo_spare = NULL;
+}
+
+/* Return SIZE bytes from the arena.  */
+
+static void *
+undo_alloc (size_t size)
+{
+  struct undo_chunk *chunk = undo_chunk;
+  void *p;
+
+  size = UNDO_ALIGN (size);
+  if (chunk == NULL || chunk->size - undo_used < size)
+    {
+      if (size <= UNDO_CHUNK_SIZE && undo_spare != NULL)
+	{
+	  chunk = undo_spare;
+	  undo_spare = NULL;
+	}
+      else
+	{
+	  size_t chunk_size = (size > UNDO_CHUNK_SIZE
+			       ? size : UNDO_CHUNK_SIZE);
+
+	  chunk = cexcept_xmalloc (offsetof (struct undo_chunk, data)
+				   + chunk_size);
+	  chunk->size = chunk_size;
+	}
+      chunk->prev = undo_chunk;
+      undo_chunk = chunk;
+      undo_used = 0;
+    }
+
+  p = (char *) chunk->data + undo_used;
+  undo_used += size;
+  return p;
+}
+
+/* Start a run of records in JOURNAL, at the arena's current
+   position.  */
+
+void
+cexcept_undo_open (struct cexcept_undo *journal)
+{
+  journal->last = NULL;
+  journal->chunk = undo_chunk;
+  journal->used = undo_used;
+}
+
+/* Save the SIZE bytes at PTR in a new record of JOURNAL's run.  */
+
+void
+cexcept_undo_record (struct cexcept_undo *journal, void *ptr, size_t size)
+{
+  struct cexcept_undo_record *record
+    = undo_alloc (offsetof (struct cexcept_undo_record, bytes) + size);
+
+  record->prev = journal->last;
+  record->ptr = ptr;
+  record->size = size;
+  memcpy (record->bytes, ptr, size);
+  journal->last = record;
+}
+
+/* The function of undo cleanups: copy the records of the run ARG, a
+   struct cexcept_undo, back where they came from, newest first.  */
+
+void
+cexcept_undo_restore (void *arg)
+{
+  struct cexcept_undo *journal = arg;
+  struct cexcept_undo_record *record;
+
+  for (record = journal->last; record != NULL; record = record->prev)
+    memcpy (record->ptr, record->bytes, record->size);
+}
+
+/* The destructor of undo cleanups: release the arena back to where it
+   was when the run ARG, a struct cexcept_undo, started.  */
+
+void
+cexcept_undo_release (void *arg)
+{
+  struct cexcept_undo *journal = arg;
+
+  while (undo_chunk != journal->chunk)
+    {
+      struct undo_chunk *chunk = undo_chunk;
+
+      undo_chunk = chunk->prev;
+      if (undo_spare == NULL && chunk->size == UNDO_CHUNK_SIZE)
+	{
+	  if (!undo_spare_cleanup)
+	    {
+	      undo_spare_cleanup = 1;
+	      cexcept_make_thread_final_cleanup (undo_thread_exit, NULL);
+	    }
+	  undo_spare = chunk;
+	}
+      else
+	cexcept_xfree (chunk);
+    }
+  undo_used = journal->used;
+}